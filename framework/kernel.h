@@ -14,15 +14,27 @@ MODULE {
   void (*init)();
   void *(*alloc)(size_t size);
   void (*free)(void *ptr);
+  void *(*realloc)(void *ptr, size_t size);
+  void *(*alloc_pages)(int order);
+  void (*free_pages)(void *ptr);
 } MOD_NAME(pmm);
 
 typedef struct thread thread_t;
+typedef struct thread_attr thread_attr_t;
 typedef struct spinlock spinlock_t;
 typedef struct semaphore sem_t;
+typedef struct mutex mutex_t;
+typedef struct rwlock rwlock_t;
+typedef struct condvar cond_t;
 MODULE {
   void (*init)();
   int (*create)(thread_t *thread, void (*entry)(void *arg), void *arg);
+  int (*create_attr)(thread_t *thread, const thread_attr_t *attr,
+                     void (*entry)(void *arg), void *arg);
   void (*teardown)(thread_t *thread);
+  int (*set_priority)(thread_t *thread, int priority);
+  int (*set_tickets)(thread_t *thread, int tickets);
+  int (*wait_period)();
   thread_t *(*schedule)();
   void (*spin_init)(spinlock_t *lk, const char *name);
   void (*spin_lock)(spinlock_t *lk);
@@ -30,6 +42,21 @@ MODULE {
   void (*sem_init)(sem_t *sem, const char *name, int value);
   void (*sem_wait)(sem_t *sem);
   void (*sem_signal)(sem_t *sem);
+  void (*mutex_init)(mutex_t *mutex, const char *name);
+  void (*mutex_lock)(mutex_t *mutex);
+  void (*mutex_unlock)(mutex_t *mutex);
+  void (*rwlock_init)(rwlock_t *lk, const char *name, int sleepable);
+  void (*read_lock)(rwlock_t *lk);
+  void (*read_unlock)(rwlock_t *lk);
+  void (*write_lock)(rwlock_t *lk);
+  void (*write_unlock)(rwlock_t *lk);
+  void (*rcu_read_lock)();
+  void (*rcu_read_unlock)();
+  void (*synchronize_rcu)();
+  void (*cond_init)(cond_t *cond, const char *name);
+  void (*cond_wait)(cond_t *cond, mutex_t *mutex);
+  void (*cond_signal)(cond_t *cond);
+  void (*cond_broadcast)(cond_t *cond);
 } MOD_NAME(kmt);
 
 typedef struct filesystem filesystem_t;
@@ -2,6 +2,19 @@
 #include <os.h>
 #include <common.h>
 
+#ifdef GAME
+// the game thread is released once a frame at 60 fps
+#define GAME_PERIOD 16
+#define GAME_BUDGET 8
+
+static void game(void *arg) {
+  extern void jmp_game();
+  jmp_game();
+  while (1)
+    kmt->wait_period();
+}
+#endif
+
 int main() {
   // AM initialization
   _ioe_init();
@@ -20,12 +33,16 @@ int main() {
 #endif
 
 #ifdef GAME
-  extern void jmp_game();
-  jmp_game();
+  thread_t game_thread;
+  thread_attr_t game_attr = THREAD_ATTR_INIT;
+  game_attr.policy = SCHED_EDF;
+  game_attr.period = GAME_PERIOD;
+  game_attr.budget = GAME_BUDGET;
+  kmt->create_attr(&game_thread, &game_attr, game, NULL);
 #endif
 
-  // call os->run()
-  if (os->run) os->run();
+  // call os->run() on every CPU
+  if (os->run) _mpe_init(os->run);
 
   _halt(1); // should not reach here
   return -1;
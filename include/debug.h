@@ -10,6 +10,7 @@
 #define GAME
 // #define DEBUG_MEM
 // #define DEBUG_LOCK
+// #define DEBUG_LOCKSTAT
 // #define DEBUG_SCHEDULE
 // #define TRACE
 
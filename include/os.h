@@ -8,17 +8,187 @@
                 spinlock.h
   ------------------------------------------*/
 
+// A ticket lock: the holder's ticket is owner, the next one to
+// hand out is next. Waiters get the lock in FIFO order.
 struct spinlock {
-  int locked;
+  volatile int next;
+  volatile int owner;
   const char *name;
+  uint64_t acquired;  // rdtsc() when taken, for DEBUG_LOCKSTAT
 };
 
 #define SPINLOCK_INIT(NAME) \
   (struct spinlock) { \
+    .next = 0, \
+    .owner = 0, \
+    .name = (NAME), \
+    .acquired = 0, \
+  }
+
+/*------------------------------------------
+                waitqueue.h
+  ------------------------------------------*/
+
+// Blocked threads, linked through their wq_prev and wq_next, so
+// blocking and waking never allocate. The caller holds the lock
+// that protects the queue around every call.
+typedef struct waitqueue waitqueue_t;
+
+struct waitqueue {
+  struct thread *head;
+  struct thread *tail;
+};
+
+void waitqueue_init(waitqueue_t *wq);
+int waitqueue_empty(waitqueue_t *wq);
+// Block the current thread and release lk, take lk again once woken.
+void waitqueue_sleep(waitqueue_t *wq, spinlock_t *lk);
+// Return the thread woken, NULL if there is none.
+thread_t *waitqueue_wake_one(waitqueue_t *wq);
+// Wake every waiter in one pass, return how many.
+int waitqueue_wake_all(waitqueue_t *wq);
+
+// Sleep on wq until cond holds, checked with lk held. Whoever
+// makes cond true wakes wq under lk.
+#define waitqueue_wait_event(wq, lk, cond) \
+  do { \
+    while (!(cond)) \
+      waitqueue_sleep((wq), (lk)); \
+  } while (0)
+
+/*------------------------------------------
+                  mutex.h
+  ------------------------------------------*/
+
+// A sleeping lock for long critical sections. The caller spins
+// for a while as long as the owner is running, then blocks.
+// Never take it while holding a spin lock.
+struct mutex {
+  volatile int locked;
+  int nwaiters;           // threads past the spinning phase
+  struct thread *owner;
+  spinlock_t lock;        // protects nwaiters and waiters
+  waitqueue_t waiters;
+  const char *name;
+};
+
+#define MUTEX_INIT(NAME) \
+  (struct mutex) { \
     .locked = 0, \
+    .nwaiters = 0, \
+    .owner = NULL, \
+    .lock = { .next = 0, .owner = 0, .name = (NAME) }, \
+    .waiters = { NULL, NULL }, \
     .name = (NAME), \
   }
 
+/*------------------------------------------
+                  rwlock.h
+  ------------------------------------------*/
+
+// Many readers or one writer. A waiting writer holds back new
+// readers. The spinning flavour keeps interrupts off like a
+// spin lock; the sleeping one blocks and must not be taken
+// while holding a spin lock. It hands the lock straight to the
+// writer it wakes, so readers can't slip in before it runs.
+struct rwlock {
+  volatile int state;     // readers holding it, -1 for a writer
+  volatile int writers;   // spinning writers waiting
+  int nwriters_waiting;   // sleeping writers that don't have it yet
+  int sleepable;
+  spinlock_t lock;        // sleeping flavour: protects state and queues
+  waitqueue_t read_waiters;
+  waitqueue_t write_waiters;
+  const char *name;
+};
+
+#define RWLOCK_INIT(NAME, SLEEPABLE) \
+  (struct rwlock) { \
+    .state = 0, \
+    .writers = 0, \
+    .nwriters_waiting = 0, \
+    .sleepable = (SLEEPABLE), \
+    .lock = { .next = 0, .owner = 0, .name = (NAME) }, \
+    .read_waiters = { NULL, NULL }, \
+    .write_waiters = { NULL, NULL }, \
+    .name = (NAME), \
+  }
+
+/*------------------------------------------
+                    rcu.h
+  ------------------------------------------*/
+
+// Readers between rcu_read_lock and rcu_read_unlock only keep
+// interrupts off on their own CPU. A writer unlinks a node, waits
+// in synchronize_rcu until every CPU has scheduled once, then no
+// reader can still see it and it may be freed.
+
+// Publish v at p after its fields are written.
+#define rcu_assign_pointer(p, v) \
+  do { \
+    __asm__ __volatile__ ("" ::: "memory"); \
+    (p) = (v); \
+  } while (0)
+
+// Load a pointer published by rcu_assign_pointer.
+#define rcu_dereference(p) (*(__typeof__(p) volatile *)&(p))
+
+/*------------------------------------------
+                    cpu.h
+  ------------------------------------------*/
+
+#define MAX_CPU 8
+
+static inline uint64_t rdtsc() {
+  uint32_t lo, hi;
+  __asm__ __volatile__ ("rdtsc" : "=a"(lo), "=d"(hi));
+  return ((uint64_t)hi << 32) | lo;
+}
+
+// Sleep until the next interrupt, which must be enabled.
+static inline void hlt() {
+  __asm__ __volatile__ ("hlt");
+}
+
+// Tell the CPU we are spinning ("rep; nop" is pause).
+static inline void cpu_relax() {
+  __asm__ __volatile__ ("rep; nop" ::: "memory");
+}
+
+// Add val to *addr. Returns the old value.
+static inline int atomic_xadd(volatile int *addr, int val) {
+  __asm__ __volatile__ ("lock xaddl %0, %1"
+    : "+r"(val), "+m"(*addr) : : "memory");
+  return val;
+}
+
+// Store val if *addr equals old. Returns the value seen.
+static inline int atomic_cmpxchg(volatile int *addr, int old, int val) {
+  int ret;
+  __asm__ __volatile__ ("lock cmpxchgl %2, %1"
+    : "=a"(ret), "+m"(*addr) : "r"(val), "0"(old) : "memory");
+  return ret;
+}
+
+// Per-CPU state. Interrupts must be disabled while it is used,
+// or the thread may move to another CPU in between.
+struct cpu {
+  struct thread *current;
+  struct thread *idle;
+  struct thread *prev;  // switched out, but its stack is still in use
+  int nintr;            // nesting depth of push_intr
+  int intr_save;        // interrupt state before the first push_intr
+  volatile uint32_t rcu_qs;  // schedules so far, each a quiescent state
+};
+
+extern struct cpu cpus[MAX_CPU];
+
+#define mycpu()     (&cpus[_cpu()])
+
+// safe to use with interrupts enabled
+struct thread *current_thread();
+#define cur_thread  (current_thread())
+
 /*------------------------------------------
                   string.h
   ------------------------------------------*/
@@ -27,21 +197,116 @@ typedef struct string {
   char *data;
   size_t capacity;
   size_t size;
-  spinlock_t lock;
+  mutex_t lock;     // held across realloc and copies, may sleep
 } string_t;
 
-// thread safe
+// thread safe, not for interrupt context or under a spin lock
 void string_init(string_t *s);
 void string_destroy(string_t *s);
 int string_empty(string_t *s);
 size_t string_length(string_t *s);
 size_t string_capacity(string_t *s);
-void string_cat(string_t *s1, const char *s2);
+int string_cat(string_t *s1, const char *s2);
+void string_clear(string_t *s);
 void string_print(string_t *s);
 ssize_t string_read(string_t *s, off_t offset, void *buf, size_t size);
 ssize_t string_write(string_t *s, off_t offset, const void *buf, size_t size);
 int string_equal(string_t *s1, const char *s2);
 
+/*------------------------------------------
+                  slab.h
+  ------------------------------------------*/
+
+// A slab cache hands out objects of one fixed size.
+// Each slab is a page carved into objects, so alloc and
+// free only pop and push the per-slab free list.
+typedef struct slab_cache {
+  const char *name;
+  size_t objsize;
+  int objs_per_slab;
+  struct slab *partial;
+  struct slab *full;
+  struct slab *empty;
+  int nslabs;
+  int nobjs;    // objects in use
+  int registered;
+  struct slab_cache *next;
+  spinlock_t lock;
+} slab_cache_t;
+
+#define SLAB_CACHE_INIT(NAME, SIZE) \
+  (struct slab_cache) { \
+    .name = (NAME), \
+    .objsize = (SIZE), \
+    .objs_per_slab = 0, \
+    .partial = NULL, \
+    .full = NULL, \
+    .empty = NULL, \
+    .nslabs = 0, \
+    .nobjs = 0, \
+    .registered = 0, \
+    .next = NULL, \
+    .lock = { .next = 0, .owner = 0, .name = (NAME) }, \
+  }
+
+// thread safe
+void slab_cache_init(slab_cache_t *cache, const char *name, size_t objsize);
+void slab_cache_destroy(slab_cache_t *cache);
+void *slab_cache_alloc(slab_cache_t *cache);
+void slab_cache_free(slab_cache_t *cache, void *obj);
+size_t slab_cache_shrink(slab_cache_t *cache);
+void slab_info_render(string_t *out);
+
+/*------------------------------------------
+                    pmm.h
+  ------------------------------------------*/
+
+// Shrinkers give cached memory back when the heap runs out.
+// The allocator calls them in ascending priority before it
+// fails, and they return the number of bytes released.
+// A shrinker may only take locks of its own subsystem.
+#define NR_SHRINKERS 16
+
+enum {
+  SHRINK_PRI_MAGAZINE = 0,
+  SHRINK_PRI_SLAB = 10,
+  SHRINK_PRI_FREELIST = 20,
+};
+
+typedef size_t (*shrinker_t)();
+
+// thread safe
+void pmm_add_shrinker(const char *name, int priority, shrinker_t shrink);
+
+void magazine_info_render(string_t *out);
+void meminfo_render(string_t *out);
+
+// only available with DEBUG_MEM
+void memtrace_render(string_t *out);
+void memleak_render(string_t *out);
+
+/*------------------------------------------
+                  arena.h
+  ------------------------------------------*/
+
+// An arena hands out memory by bumping a pointer through pages
+// from pmm, and everything in it is freed at once by reset or
+// destroy. An arena is owned by one thread and not thread safe.
+typedef struct arena {
+  struct arena_block *blocks;   // current block first
+  char *cur;
+  char *end;
+} arena_t;
+
+arena_t *arena_create();
+void arena_destroy(arena_t *arena);
+void *arena_alloc(arena_t *arena, size_t size);
+void arena_reset(arena_t *arena);
+
+// Default arena of the running thread, created on first use.
+// Whoever opens a request scope resets it when done.
+arena_t *thread_arena();
+
 /*------------------------------------------
                 inode_manager.h
   ------------------------------------------*/
@@ -68,7 +333,7 @@ struct inode {
 // implemented as tree
 typedef struct inode_manager {
   inode_t *root;
-  spinlock_t lock;
+  rwlock_t lock;
 } inode_manager_t;
 
 // threadsafe
@@ -86,6 +351,7 @@ ssize_t inode_manager_read(inode_manager_t *inode_manager, inode_t *inode,
 ssize_t inode_manager_write(inode_manager_t *inode_manager, inode_t *inode,
                             off_t offset, const void *buf, size_t size);
 int inode_manager_cmp_name(inode_manager_t *inode_manager, inode_t *inode, const char *name);
+void inode_manager_truncate(inode_manager_t *inode_manager, inode_t *inode);
 
 /*------------------------------------------
                   filesystem.h
@@ -112,8 +378,9 @@ struct file {
   int ref_count;
   int readable;
   int writable;
+  string_t *snapshot;   // procfs dyninfo rendered at open, or NULL
   // thread safe
-  spinlock_t lock;
+  mutex_t lock;
   file_ops_t ops;
 };
 
@@ -129,7 +396,7 @@ typedef struct filesystem_ops {
 struct filesystem {
   const char *name;
   inode_manager_t inode_manager;
-  spinlock_t lock;
+  rwlock_t lock;        // opens read, procfs updates write
   filesystem_ops_t ops;
 };
 
@@ -147,6 +414,20 @@ void procfs_add_metainfo(filesystem_t *procfs, const char *name,
                          const char *content, size_t size);
 void procfs_add_procinfo(filesystem_t *procfs, int tid, const char *name,
                          const char *content, size_t size);
+void procfs_remove_procinfo(filesystem_t *procfs, int tid);
+
+// Content of dyninfo is rendered into out every time it is opened,
+// and the opened file reads its own copy.
+// Render may take temporaries from thread_arena().
+typedef void (*procfs_render_t)(string_t *out);
+void procfs_add_dyninfo(filesystem_t *procfs, const char *name,
+                        procfs_render_t render);
+// Same as dyninfo, but there is one /<tid>/<name> for every thread,
+// created by procfs_add_thread.
+typedef void (*procfs_thread_render_t)(int tid, string_t *out);
+void procfs_add_thread_dyninfo(filesystem_t *procfs, const char *name,
+                               procfs_thread_render_t render);
+void procfs_add_thread(filesystem_t *procfs, int tid);
 
 file_t *file_table_alloc_stdin();
 file_t *file_table_alloc_stdout();
@@ -196,54 +477,94 @@ void fs_manager_print();
   ------------------------------------------*/
 
 #define PGSIZE            4096
-#define MAX_KSTACK_SIZE   4 * PGSIZE 
-#define MAX_TIMESLICE     2
+#define KSTACK_ORDER      2
+#define MAX_KSTACK_SIZE   (PGSIZE << KSTACK_ORDER)
+#define MAX_TIMESLICE     2   // quantum at level 0, doubled per level
+#define NR_PRIO           4   // levels of the feedback queue, 0 is highest
+#define DEFAULT_TICKETS   100
+#define MAX_TICKETS       10000
 
 enum { RUNNABLE, RUNNING, BLOCKED, DEAD };
 
+// scheduling classes, served from the last one to the first
+enum { SCHED_MLFQ, SCHED_STRIDE, SCHED_EDF };
+
 struct thread {
   int tid;
   int stat;
   int timeslice;
+  int oncpu;        // running, or its stack is still in use by a CPU
+  int cpu;          // the only CPU to run on, -1 for any
+  int last_cpu;
+  int policy;
+  int prio;         // highest level it is boosted to
+  int level;        // current level, lowered as it uses up quanta
+  int tickets;      // share of a stride thread
+  uint32_t stride;
+  uint64_t pass;
+  int ticks;        // ticks it has run
+  int start_ticks;  // ticks of all CPUs when it was created
+  uint32_t period;  // EDF times are in ms of uptime()
+  uint32_t budget;
+  uint32_t release; // start of the next period
+  uint32_t deadline;
+  uint32_t rt_used; // time run in this period
+  uint32_t rt_start;
+  int rt_waiting;   // on the release list
+  struct thread *rt_next;
+  uint64_t wake_tsc; // when it was woken up, 0 once it runs
+  waitqueue_t *wq;  // queue it sleeps on
+  spinlock_t *wq_lock; // lock of that queue until it runs again
+  struct thread *wq_prev;
+  struct thread *wq_next;
+  int queued;       // on a run queue, or being added to one
+  int rq_cpu;       // run queue it is linked to, -1 for none
+  int rq_list;      // run queue list it is linked to
+  struct thread *rq_prev;
+  struct thread *rq_next;
   uint8_t *kstack;
   _RegSet *regs;
   fd_table_t fd_table;
+  arena_t *arena;
   struct thread *next;
 };
 
-thread_t *new_thread(void (*entry)(void *), void *arg);
-void delete_thread(thread_t *thread);
-
-/*------------------------------------------
-                threadlist.h
-  ------------------------------------------*/
+// A thread with pin_cpu set runs only on that CPU: it is always
+// queued there, and stealing and balancing leave it alone. -1, or
+// a CPU that does not exist, lets it run anywhere.
+struct thread_attr {
+  int pin_cpu;
+  int policy;
+  int priority;     // 0 .. NR_PRIO - 1
+  int tickets;      // 1 .. MAX_TICKETS
+  int period;       // ms, for SCHED_EDF
+  int budget;       // ms in every period, 1 .. period
+};
 
-extern thread_t *idle;
-extern thread_t *cur_thread;
+#define THREAD_ATTR_INIT \
+  (struct thread_attr) { \
+    .pin_cpu = -1, \
+    .policy = SCHED_MLFQ, \
+    .priority = 0, \
+    .tickets = DEFAULT_TICKETS, \
+    .period = 0, \
+    .budget = 0, \
+  }
 
-void threadlist_add(thread_t *thread);
-thread_t *threadlist_remove(int tid);
-void threadlist_print();
+thread_t *new_thread(void (*entry)(void *), void *arg);
+void delete_thread(thread_t *thread);
 
 /*------------------------------------------
-                threadqueue.h
+                threadtable.h
   ------------------------------------------*/
 
-typedef struct _threadqueue_node {
-  struct thread *thread;
-  struct _threadqueue_node *next;
-} threadqueue_node;
-
-typedef struct _threadqueue {
-  threadqueue_node *head;
-  threadqueue_node *tail;
-  int size;
-} threadqueue;
-
-void threadqueue_init(threadqueue *queue);
-int threadqueue_empty(threadqueue *queue);
-void threadqueue_push(threadqueue *queue, thread_t *thread);
-thread_t *threadqueue_pop(threadqueue *queue);
+void threadtable_add(thread_t *thread);
+thread_t *threadtable_remove(int tid);
+void threadtable_print();
+void schedstat_render(string_t *out);
+// only available with DEBUG_LOCKSTAT
+void lockstat_render(string_t *out);
+void thread_sched_render(int tid, string_t *out);
 
 /*------------------------------------------
                 semaphore.h
@@ -251,15 +572,32 @@ thread_t *threadqueue_pop(threadqueue *queue);
 
 struct semaphore {
   int count;
-  threadqueue queue;
+  waitqueue_t queue;
   struct spinlock lock;
 };
 
 #define SEM_INIT(NAME, VALUE) \
   (struct semaphore) { \
     .count = (VALUE), \
-    .queue = { NULL, NULL, 0 }, \
-    .lock = { 0, (NAME) }, \
+    .queue = { NULL, NULL }, \
+    .lock = { .next = 0, .owner = 0, .name = (NAME) }, \
+  }
+
+/*------------------------------------------
+                  condvar.h
+  ------------------------------------------*/
+
+// Waiters hold a mutex that guards the condition, cond_wait
+// drops it while asleep. Recheck the condition after waking.
+struct condvar {
+  waitqueue_t waiters;
+  struct spinlock lock;
+};
+
+#define COND_INIT(NAME) \
+  (struct condvar) { \
+    .waiters = { NULL, NULL }, \
+    .lock = { .next = 0, .owner = 0, .name = (NAME) }, \
   }
 
 #endif
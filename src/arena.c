@@ -0,0 +1,107 @@
+#include <os.h>
+#include <common.h>
+
+#define ARENA_ORDER  0
+#define ARENA_ALIGN  8
+
+// Blocks come from pmm->alloc_pages and start with this header.
+// The arena itself lives in its first block, which is kept
+// by reset.
+typedef struct arena_block {
+  struct arena_block *next;
+  int order;
+} arena_block_t;
+
+static inline size_t size_aligned(size_t size, size_t align) {
+  return ((size + align - 1) / align) * align;
+}
+
+#define BLOCK_HDRSIZE  size_aligned(sizeof(arena_block_t), ARENA_ALIGN)
+
+static inline char *block_data(arena_block_t *block) {
+  return (char *)block + BLOCK_HDRSIZE;
+}
+
+static inline char *block_end(arena_block_t *block) {
+  return (char *)block + (PGSIZE << block->order);
+}
+
+static arena_block_t *new_block(size_t size) {
+  size += BLOCK_HDRSIZE;
+  int order = ARENA_ORDER;
+  while ((PGSIZE << order) < size)
+    order++;
+
+  arena_block_t *block = pmm->alloc_pages(order);
+  if (block == NULL)
+    return NULL;
+  block->next = NULL;
+  block->order = order;
+  return block;
+}
+
+static inline arena_block_t *first_block(arena_t *arena) {
+  return (arena_block_t *)((char *)arena - BLOCK_HDRSIZE);
+}
+
+static inline char *first_data(arena_t *arena) {
+  return (char *)arena + size_aligned(sizeof(arena_t), ARENA_ALIGN);
+}
+
+arena_t *arena_create() {
+  arena_block_t *block = new_block(sizeof(arena_t));
+  if (block == NULL)
+    return NULL;
+  arena_t *arena = (arena_t *)block_data(block);
+  arena->blocks = block;
+  arena->cur = first_data(arena);
+  arena->end = block_end(block);
+  return arena;
+}
+
+void arena_destroy(arena_t *arena) {
+  Assert(arena != NULL);
+  arena_block_t *block = arena->blocks;
+  while (block != NULL) {
+    arena_block_t *next = block->next;
+    pmm->free_pages(block);
+    block = next;
+  }
+}
+
+void *arena_alloc(arena_t *arena, size_t size) {
+  Assert(arena != NULL);
+  size = size_aligned(size, ARENA_ALIGN);
+  if ((size_t)(arena->end - arena->cur) < size) {
+    // the rest of the current block is wasted
+    arena_block_t *block = new_block(size);
+    if (block == NULL)
+      return NULL;
+    block->next = arena->blocks;
+    arena->blocks = block;
+    arena->cur = block_data(block);
+    arena->end = block_end(block);
+  }
+  void *ret = arena->cur;
+  arena->cur += size;
+  return ret;
+}
+
+void arena_reset(arena_t *arena) {
+  Assert(arena != NULL);
+  arena_block_t *first = first_block(arena);
+  while (arena->blocks != first) {
+    arena_block_t *next = arena->blocks->next;
+    pmm->free_pages(arena->blocks);
+    arena->blocks = next;
+  }
+  arena->cur = first_data(arena);
+  arena->end = block_end(first);
+}
+
+arena_t *thread_arena() {
+  Assert(cur_thread != NULL);
+  if (cur_thread->arena == NULL)
+    cur_thread->arena = arena_create();
+  return cur_thread->arena;
+}
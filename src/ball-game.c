@@ -2,6 +2,7 @@
 #include <amdev.h>
 #include <amdevutil.h>
 #include <klib.h>
+#include <kernel.h>
 
 typedef struct Screen {
   int fps, width, height;
@@ -21,8 +22,10 @@ static void init_screen(SCREEN *screen, int fps) {
 }
 
 static void wait_next_frame(SCREEN *screen) {
-  while (uptime() < screen->next_frame)
-    continue;
+  // a periodic thread sleeps until its next period instead
+  if (kmt->wait_period() != 0)
+    while (uptime() < screen->next_frame)
+      continue;
   screen->next_frame += 1000 / screen->fps;
 }
 
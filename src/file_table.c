@@ -27,7 +27,8 @@ file_t *file_table_alloc(inode_t *inode, inode_manager_t *inode_manager,
       file->ref_count = 1;
       file->writable = (writable ? 1 : 0);
       file->readable = (readable ? 1 : 0);
-      kmt->spin_init(&file->lock, "file_lock");
+      file->snapshot = NULL;
+      kmt->mutex_init(&file->lock, "file_lock");
       file->ops = *ops;
       is_free[i] = 0;
       kmt->spin_unlock(&lock);
@@ -40,6 +41,12 @@ file_t *file_table_alloc(inode_t *inode, inode_manager_t *inode_manager,
 
 void file_table_free(file_t *file) {
   Assert(file != NULL);
+  // the slot is still ours, and string_destroy may sleep
+  if (file->snapshot != NULL) {
+    string_destroy(file->snapshot);
+    pmm->free(file->snapshot);
+    file->snapshot = NULL;
+  }
   kmt->spin_lock(&lock);
   file->ops.read_handle = NULL;
   file->ops.write_handle = NULL;
@@ -10,16 +10,16 @@ void filesystem_init(filesystem_t *fs, const char *name, filesystem_ops_t *ops)
   fs->name = name;
   inode_manager_init(&fs->inode_manager);
   fs->ops = *ops;
-  kmt->spin_init(&fs->lock, "filesystem_lock");
+  kmt->rwlock_init(&fs->lock, "filesystem_lock", 1);
 }
 
 void filesystem_destroy(filesystem_t *fs) {
   Assert(fs != NULL);
-  kmt->spin_lock(&fs->lock);
+  kmt->write_lock(&fs->lock);
   inode_manager_destroy(&fs->inode_manager);
   fs->ops.access_handle = NULL;
   fs->ops.open_handle = NULL;
-  kmt->spin_unlock(&fs->lock);
+  kmt->write_unlock(&fs->lock);
 }
 
 filesystem_t *new_filesystem(const char *name, filesystem_ops_t *ops) {
@@ -38,11 +38,11 @@ void delete_filesystem(filesystem_t *fs) {
 // basic file system's implementation
 static ssize_t basic_file_read(file_t *this, void *buf, size_t size) {
   Assert(this != NULL && buf != NULL);
-  kmt->spin_lock(&this->lock);
+  kmt->mutex_lock(&this->lock);
 
   if (!this->readable) {
     Log("Read permission denied!");
-    kmt->spin_unlock(&this->lock);
+    kmt->mutex_unlock(&this->lock);
     return -1;
   }
 
@@ -50,29 +50,30 @@ static ssize_t basic_file_read(file_t *this, void *buf, size_t size) {
                                      this->offset, buf, size);
   this->offset += nread;
 
-  kmt->spin_unlock(&this->lock);
+  kmt->mutex_unlock(&this->lock);
   return nread;
 }
 
 static ssize_t basic_file_write(file_t *this, const void *buf, size_t size) {
-  kmt->spin_lock(&this->lock);
+  kmt->mutex_lock(&this->lock);
 
   if (!this->writable) {
     Log("Write permission denied!");
-    kmt->spin_unlock(&this->lock);
+    kmt->mutex_unlock(&this->lock);
     return -1;
   }
 
   ssize_t nwritten = inode_manager_write(this->inode_manager, this->inode,
                                          this->offset, buf, size);
-  this->offset += nwritten;
+  if (nwritten > 0)
+    this->offset += nwritten;
 
-  kmt->spin_unlock(&this->lock);
+  kmt->mutex_unlock(&this->lock);
   return nwritten;
 }
 
 static off_t basic_file_lseek(file_t *this, off_t offset, int whence) {
-  kmt->spin_lock(&this->lock);
+  kmt->mutex_lock(&this->lock);
   size_t filesize = inode_manager_get_filesize(this->inode_manager, this->inode);
   switch (whence) {
     case SEEK_SET: break;
@@ -82,48 +83,49 @@ static off_t basic_file_lseek(file_t *this, off_t offset, int whence) {
   }
   if (offset > filesize || offset < 0) {
     Log("Offset is out of bound!");
-    kmt->spin_unlock(&this->lock);
+    kmt->mutex_unlock(&this->lock);
     return -1;
   }
   this->offset = offset;
-  kmt->spin_unlock(&this->lock);
+  kmt->mutex_unlock(&this->lock);
   return offset;
 }
 
 static int basic_file_close(file_t *this) {
-  kmt->spin_lock(&this->lock);
-  this->ref_count--;
-  if (this->ref_count == 0)
+  kmt->mutex_lock(&this->lock);
+  int last = (--this->ref_count == 0);
+  kmt->mutex_unlock(&this->lock);
+  // a freed slot may be handed out and its lock reset at once
+  if (last)
     file_table_free(this);
-  kmt->spin_unlock(&this->lock);
   return 0;
 }
 
 static int basic_fs_access(filesystem_t *this, const char *path, int mode) {
   Assert(this != NULL && path != NULL);
   Assert((mode & ~R_OK & ~W_OK & ~X_OK) == 0);
-  kmt->spin_lock(&this->lock);
+  kmt->read_lock(&this->lock);
   inode_manager_t *manager = &this->inode_manager;
   inode_t *inode = inode_manager_lookup(manager, path, INODE_FILE, 0, 0);
   if (inode == NULL) {
-    kmt->spin_unlock(&this->lock);
+    kmt->read_unlock(&this->lock);
     return 0;
   }
   int ok = inode_manager_checkmode(manager, inode, mode);
-  kmt->spin_unlock(&this->lock);
+  kmt->read_unlock(&this->lock);
   return ok;
 }
 
 static file_t *basic_fs_open(filesystem_t *this, const char *path, int flags, file_ops_t *ops) {
   Assert(this != NULL && path != NULL);
-  kmt->spin_lock(&this->lock);
+  kmt->read_lock(&this->lock);
   // get inode
   inode_manager_t *manager = &this->inode_manager;
   inode_t *inode = inode_manager_lookup(manager, path, INODE_FILE,
                                         (flags & O_CREAT), DEFAULT_MODE);
   if (inode == NULL) {
     Log("Can't find path %s", path);
-    kmt->spin_unlock(&this->lock);
+    kmt->read_unlock(&this->lock);
     return NULL;
   }
 
@@ -139,14 +141,14 @@ static file_t *basic_fs_open(filesystem_t *this, const char *path, int flags, fi
   }  
   if (!inode_manager_checkmode(manager, inode, mode)) {
     Log("Permission denied!");
-    kmt->spin_unlock(&this->lock);
+    kmt->read_unlock(&this->lock);
     return NULL;
   }
 
   // allocate fd
   file_t *file = file_table_alloc(inode, manager, readable, writable, ops);
   Assert(file != NULL);
-  kmt->spin_unlock(&this->lock);
+  kmt->read_unlock(&this->lock);
   return file;
 }
 
@@ -201,19 +203,19 @@ filesystem_t *new_kvfs(const char *name) {
   ------------------------------------------*/
 
 static ssize_t devfs_read(file_t *this, void *buf, size_t size) {
-  kmt->spin_lock(&this->lock);
+  kmt->mutex_lock(&this->lock);
   inode_manager_t *manager = this->inode_manager;
   inode_t *inode = this->inode;
 
   if (!this->readable) {
     Log("Read permission denied!");
-    kmt->spin_unlock(&this->lock);
+    kmt->mutex_unlock(&this->lock);
     return -1;
   }
 
   // read null
   if (inode_manager_cmp_name(manager, inode, "null") == 0) {
-    kmt->spin_unlock(&this->lock); 
+    kmt->mutex_unlock(&this->lock); 
     return 0;
   }
 
@@ -222,7 +224,7 @@ static ssize_t devfs_read(file_t *this, void *buf, size_t size) {
     size_t nread;
     for (nread = 0; nread < size; ++nread)
       ((char *)buf)[nread] = 0;
-    kmt->spin_unlock(&this->lock); 
+    kmt->mutex_unlock(&this->lock); 
     return nread;
   }
 
@@ -231,46 +233,46 @@ static ssize_t devfs_read(file_t *this, void *buf, size_t size) {
     size_t nread;
     for (nread = 0; nread < size; ++nread)
       ((char *)buf)[nread] = (rand() % (1 << 8));
-    kmt->spin_unlock(&this->lock); 
+    kmt->mutex_unlock(&this->lock); 
     return nread;
   }
 
   Panic("Should not reach here!");
-  kmt->spin_unlock(&this->lock); 
+  kmt->mutex_unlock(&this->lock); 
   return -1;
 }
 
 static ssize_t devfs_write(file_t *this, const void *buf, size_t size) {
-  kmt->spin_lock(&this->lock);
+  kmt->mutex_lock(&this->lock);
   inode_manager_t *manager = this->inode_manager;
   inode_t *inode = this->inode;
 
   if (!this->writable) {
     Log("Write permission denied!");
-    kmt->spin_unlock(&this->lock);
+    kmt->mutex_unlock(&this->lock);
     return -1;
   }
 
   // write null
   if (inode_manager_cmp_name(manager, inode, "null") == 0) {
-    kmt->spin_unlock(&this->lock); 
+    kmt->mutex_unlock(&this->lock); 
     return size;
   }
 
   // write zero
   if (inode_manager_cmp_name(manager, inode, "zero") == 0) {
-    kmt->spin_unlock(&this->lock); 
+    kmt->mutex_unlock(&this->lock); 
     return 0;
   }
 
   // write random
   if (inode_manager_cmp_name(manager, inode, "random") == 0) {
-    kmt->spin_unlock(&this->lock); 
+    kmt->mutex_unlock(&this->lock); 
     return 0;
   }
 
   Panic("Should not reach here!");
-  kmt->spin_unlock(&this->lock); 
+  kmt->mutex_unlock(&this->lock); 
   return -1;
 }
 
@@ -316,8 +318,16 @@ filesystem_t *new_devfs(const char *name) {
                     procfs
   ------------------------------------------*/
 
+// dyninfo files read the snapshot taken when they were opened
 static ssize_t procfs_read(file_t *this, void *buf, size_t size) {
-  return basic_file_read(this, buf, size);
+  if (this->snapshot == NULL)
+    return basic_file_read(this, buf, size);
+  Assert(buf != NULL);
+  kmt->mutex_lock(&this->lock);
+  ssize_t nread = string_read(this->snapshot, this->offset, buf, size);
+  this->offset += nread;
+  kmt->mutex_unlock(&this->lock);
+  return nread;
 }
 
 static ssize_t procfs_write(file_t *this, const void *buf, size_t size) {
@@ -325,7 +335,24 @@ static ssize_t procfs_write(file_t *this, const void *buf, size_t size) {
 }
 
 static off_t procfs_lseek(file_t *this, off_t offset, int whence) {
-  return basic_file_lseek(this, offset, whence);
+  if (this->snapshot == NULL)
+    return basic_file_lseek(this, offset, whence);
+  kmt->mutex_lock(&this->lock);
+  size_t filesize = string_length(this->snapshot);
+  switch (whence) {
+    case SEEK_SET: break;
+    case SEEK_CUR: offset += this->offset; break;
+    case SEEK_END: offset += filesize; break;
+    default: Panic("Should not reach here");
+  }
+  if (offset > filesize || offset < 0) {
+    Log("Offset is out of bound!");
+    kmt->mutex_unlock(&this->lock);
+    return -1;
+  }
+  this->offset = offset;
+  kmt->mutex_unlock(&this->lock);
+  return offset;
 }
 
 static int procfs_close(file_t *this) {
@@ -336,6 +363,66 @@ static int procfs_access(filesystem_t *this, const char *path, int mode) {
   return basic_fs_access(this, path, mode);
 }
 
+#define NR_DYNINFO 16
+
+// dyninfo files are rendered into every file opened on them, so
+// readers never share content that is being rewritten. A thread
+// dyninfo keeps its name only in path.
+static struct {
+  filesystem_t *procfs;
+  char path[MAXPATHLEN];
+  procfs_render_t render;
+  procfs_thread_render_t thread_render;
+} dyninfo_table[NR_DYNINFO];
+static int nr_dyninfo = 0;
+
+// Split "/<tid>/<name>", return the name or NULL.
+static const char *procfs_thread_path(const char *path, int *tid) {
+  if (*path++ != '/' || *path < '0' || *path > '9')
+    return NULL;
+  *tid = 0;
+  while (*path >= '0' && *path <= '9')
+    *tid = *tid * 10 + (*path++ - '0');
+  return *path == '/' ? path + 1 : NULL;
+}
+
+// Render the dyninfo matching path into a new string, NULL for
+// static files. Renderers run without the procfs lock.
+static string_t *procfs_render_dyninfo(filesystem_t *procfs, const char *path) {
+  int tid = -1;
+  const char *name = procfs_thread_path(path, &tid);
+  procfs_render_t render = NULL;
+  procfs_thread_render_t thread_render = NULL;
+
+  kmt->read_lock(&procfs->lock);
+  for (int i = 0; i < nr_dyninfo; ++i) {
+    if (dyninfo_table[i].procfs != procfs)
+      continue;
+    if (dyninfo_table[i].thread_render != NULL ?
+        name == NULL || strcmp(dyninfo_table[i].path, name) != 0 :
+        strcmp(dyninfo_table[i].path, path) != 0)
+      continue;
+    render = dyninfo_table[i].render;
+    thread_render = dyninfo_table[i].thread_render;
+    break;
+  }
+  kmt->read_unlock(&procfs->lock);
+  if (render == NULL && thread_render == NULL)
+    return NULL;
+
+  string_t *content = pmm->alloc(sizeof(string_t));
+  if (content == NULL)
+    return NULL;
+  // temporaries of render come from the thread arena
+  string_init(content);
+  if (thread_render != NULL)
+    thread_render(tid, content);
+  else
+    render(content);
+  arena_reset(thread_arena());
+  return content;
+}
+
 static file_t *procfs_open(filesystem_t *this, const char *path, int flags) {
   if (flags & O_CREAT) {
     Log("Forbid creating files in procfs");
@@ -346,7 +433,10 @@ static file_t *procfs_open(filesystem_t *this, const char *path, int flags) {
   ops.write_handle = procfs_write;
   ops.lseek_handle = procfs_lseek;
   ops.close_handle = procfs_close;
-  return basic_fs_open(this, path, flags, &ops);
+  file_t *file = basic_fs_open(this, path, flags, &ops);
+  if (file != NULL)
+    file->snapshot = procfs_render_dyninfo(this, path);
+  return file;
 }
 
 void procfs_add_metainfo(filesystem_t *procfs, const char *name,
@@ -356,12 +446,12 @@ void procfs_add_metainfo(filesystem_t *procfs, const char *name,
   strcpy(path, "/");
   strcat(path, name);
 
-  kmt->spin_lock(&procfs->lock);
+  kmt->write_lock(&procfs->lock);
   inode_manager_t *manager = &procfs->inode_manager;
   inode_t *inode = inode_manager_lookup(manager, path, INODE_FILE, 1, S_IRUSR);
   size_t nwritten = inode_manager_write(manager, inode, 0, content, strlen(content));
   Assert(nwritten == strlen(content));
-  kmt->spin_unlock(&procfs->lock);
+  kmt->write_unlock(&procfs->lock);
 }
 
 void procfs_add_procinfo(filesystem_t *procfs, int tid, const char *name,
@@ -374,12 +464,84 @@ void procfs_add_procinfo(filesystem_t *procfs, int tid, const char *name,
   strcat(path, "/");
   strcat(path, name);
 
-  kmt->spin_lock(&procfs->lock);
+  kmt->write_lock(&procfs->lock);
   inode_manager_t *manager = &procfs->inode_manager;
   inode_t *inode = inode_manager_lookup(manager, path, INODE_FILE, 1, S_IRUSR);
   size_t nwritten = inode_manager_write(manager, inode, 0, content, strlen(content));
   Assert(nwritten == strlen(content));
-  kmt->spin_unlock(&procfs->lock);                          
+  kmt->write_unlock(&procfs->lock);                          
+}
+
+void procfs_remove_procinfo(filesystem_t *procfs, int tid) {
+  Assert(strcmp(procfs->name, "procfs") == 0);
+  char path[MAXPATHLEN], number[32];
+  strcpy(path, "/");
+  itoa(tid, 10, 1, number);
+  strcat(path, number);
+
+  kmt->write_lock(&procfs->lock);
+  inode_manager_t *manager = &procfs->inode_manager;
+  inode_t *inode = inode_manager_lookup(manager, path, INODE_DIR, 0, 0);
+  if (inode != NULL)
+    inode_manager_remove(manager, inode);
+  kmt->write_unlock(&procfs->lock);
+}
+
+void procfs_add_dyninfo(filesystem_t *procfs, const char *name,
+                        procfs_render_t render) {
+  Assert(strcmp(procfs->name, "procfs") == 0);
+  Assert(render != NULL);
+  char path[MAXPATHLEN];
+  strcpy(path, "/");
+  strcat(path, name);
+
+  kmt->write_lock(&procfs->lock);
+  if (nr_dyninfo == NR_DYNINFO)
+    Panic("Too many dyninfo files in procfs");
+  dyninfo_table[nr_dyninfo].procfs = procfs;
+  strcpy(dyninfo_table[nr_dyninfo].path, path);
+  dyninfo_table[nr_dyninfo].render = render;
+  dyninfo_table[nr_dyninfo].thread_render = NULL;
+  nr_dyninfo++;
+  inode_manager_lookup(&procfs->inode_manager, path, INODE_FILE, 1, S_IRUSR);
+  kmt->write_unlock(&procfs->lock);
+}
+
+void procfs_add_thread_dyninfo(filesystem_t *procfs, const char *name,
+                               procfs_thread_render_t render) {
+  Assert(strcmp(procfs->name, "procfs") == 0);
+  Assert(render != NULL);
+
+  kmt->write_lock(&procfs->lock);
+  if (nr_dyninfo == NR_DYNINFO)
+    Panic("Too many dyninfo files in procfs");
+  dyninfo_table[nr_dyninfo].procfs = procfs;
+  strcpy(dyninfo_table[nr_dyninfo].path, name);
+  dyninfo_table[nr_dyninfo].render = NULL;
+  dyninfo_table[nr_dyninfo].thread_render = render;
+  nr_dyninfo++;
+  kmt->write_unlock(&procfs->lock);
+}
+
+void procfs_add_thread(filesystem_t *procfs, int tid) {
+  Assert(strcmp(procfs->name, "procfs") == 0);
+  char path[MAXPATHLEN], number[32];
+  strcpy(path, "/");
+  itoa(tid, 10, 1, number);
+  strcat(path, number);
+  strcat(path, "/");
+  size_t len = strlen(path);
+
+  kmt->write_lock(&procfs->lock);
+  inode_manager_t *manager = &procfs->inode_manager;
+  for (int i = 0; i < nr_dyninfo; ++i) {
+    if (dyninfo_table[i].procfs != procfs ||
+        dyninfo_table[i].thread_render == NULL)
+      continue;
+    strcpy(path + len, dyninfo_table[i].path);
+    inode_manager_lookup(manager, path, INODE_FILE, 1, S_IRUSR);
+  }
+  kmt->write_unlock(&procfs->lock);
 }
 
 filesystem_t *new_procfs(const char *name) {
@@ -390,9 +552,19 @@ filesystem_t *new_procfs(const char *name) {
 
   // add cpuinfo and meminfo
   const char *cpuinfo = "I am cpu infomation!";
-  const char *meminfo = "I am memeory infomation!";
   procfs_add_metainfo(fs, "cpuinfo", cpuinfo, strlen(cpuinfo));
-  procfs_add_metainfo(fs, "meminfo", meminfo, strlen(meminfo));
+  procfs_add_dyninfo(fs, "meminfo", meminfo_render);
+  procfs_add_dyninfo(fs, "slabinfo", slab_info_render);
+  procfs_add_dyninfo(fs, "magazines", magazine_info_render);
+  procfs_add_dyninfo(fs, "schedstat", schedstat_render);
+  procfs_add_thread_dyninfo(fs, "sched", thread_sched_render);
+#ifdef DEBUG_MEM
+  procfs_add_dyninfo(fs, "memtrace", memtrace_render);
+  procfs_add_dyninfo(fs, "memleak", memleak_render);
+#endif
+#ifdef DEBUG_LOCKSTAT
+  procfs_add_dyninfo(fs, "locks", lockstat_render);
+#endif
 
   return fs;
 }
@@ -458,7 +630,7 @@ static ssize_t stdout_read(file_t *this, void *buf, size_t size) {
 }
 
 static ssize_t stdout_write(file_t *this, const void *buf, size_t size) {
-  kmt->spin_lock(&this->lock);
+  kmt->mutex_lock(&this->lock);
   size_t nwritten = 0;
   const char *bufp = buf;
   while (size > 0) {
@@ -466,7 +638,7 @@ static ssize_t stdout_write(file_t *this, const void *buf, size_t size) {
     nwritten++;
     size--;
   }
-  kmt->spin_unlock(&this->lock);
+  kmt->mutex_unlock(&this->lock);
   return nwritten;
 }
 
@@ -497,7 +669,7 @@ static ssize_t stderr_read(file_t *this, void *buf, size_t size) {
 }
 
 static ssize_t stderr_write(file_t *this, const void *buf, size_t size) {
-  kmt->spin_lock(&this->lock);
+  kmt->mutex_lock(&this->lock);
   size_t nwritten = 0;
   const char *bufp = buf;
   while (size > 0) {
@@ -505,7 +677,7 @@ static ssize_t stderr_write(file_t *this, const void *buf, size_t size) {
     nwritten++;
     size--;
   }
-  kmt->spin_unlock(&this->lock);
+  kmt->mutex_unlock(&this->lock);
   return 0;
 }
 
@@ -17,7 +17,11 @@ typedef struct fs_manager {
 } fs_manager_t;
 
 static fs_manager_t fs_manager;
+// Lookups run under rcu_read_lock and walk only next, the lock
+// serialises mount and unmount.
 static spinlock_t lock = SPINLOCK_INIT("fs_manager_lock");
+static slab_cache_t node_cache = SLAB_CACHE_INIT("fs_manager_node_cache",
+                                                 sizeof(fs_manager_node_t));
 
 void fs_manager_init() {
   kmt->spin_lock(&lock);
@@ -29,7 +33,7 @@ int fs_manager_add(const char *path, filesystem_t *fs) {
   Assert(path != NULL);
   Assert(fs != NULL);
   // allocate node
-  fs_manager_node_t *node = pmm->alloc(sizeof(fs_manager_node_t));
+  fs_manager_node_t *node = slab_cache_alloc(&node_cache);
   if (node == NULL) {
     Panic("Fail to add file system");
     return -1;
@@ -45,10 +49,10 @@ int fs_manager_add(const char *path, filesystem_t *fs) {
   // add node to fs_manager
   kmt->spin_lock(&lock);
   node->next = fs_manager.head;
+  node->prev = NULL;
   if (fs_manager.head != NULL)
     fs_manager.head->prev = node;
-  fs_manager.head = node;
-  node->prev = NULL;
+  rcu_assign_pointer(fs_manager.head, node);
   kmt->spin_unlock(&lock);
 
   return 0;
@@ -56,8 +60,9 @@ int fs_manager_add(const char *path, filesystem_t *fs) {
 
 filesystem_t *fs_manager_get(const char *path, char *subpath) {
   Assert(path != NULL);
-  kmt->spin_lock(&lock);
-  for (fs_manager_node_t *cur = fs_manager.head; cur != NULL; cur = cur->next) {
+  kmt->rcu_read_lock();
+  for (fs_manager_node_t *cur = rcu_dereference(fs_manager.head); cur != NULL;
+       cur = rcu_dereference(cur->next)) {
     char *mount_point = cur->path;
     int is_found = 1;
     int i, j;
@@ -73,11 +78,11 @@ filesystem_t *fs_manager_get(const char *path, char *subpath) {
           subpath[j++] = '/';
         strcpy(subpath + j, path + i);
       }
-      kmt->spin_unlock(&lock);
+      kmt->rcu_read_unlock();
       return cur->fs;
     }
   }
-  kmt->spin_unlock(&lock);
+  kmt->rcu_read_unlock();
   return NULL;
 }
 
@@ -86,15 +91,17 @@ filesystem_t *fs_manager_remove(const char *path) {
   kmt->spin_lock(&lock);
   for (fs_manager_node_t *cur = fs_manager.head; cur != NULL; cur = cur->next)
     if (strcmp(cur->path, path) == 0) {
+      // readers may still be on cur, leave its next alone
       if (cur->prev != NULL)
-        cur->prev->next = cur->next;
+        rcu_assign_pointer(cur->prev->next, cur->next);
       else
-        fs_manager.head = cur->next;
+        rcu_assign_pointer(fs_manager.head, cur->next);
       if (cur->next != NULL)
         cur->next->prev = cur->prev;
       filesystem_t *ret = cur->fs;
-      pmm->free(cur);
       kmt->spin_unlock(&lock);
+      kmt->synchronize_rcu();
+      slab_cache_free(&node_cache, cur);
       return ret;
     }
   kmt->spin_unlock(&lock);
@@ -102,8 +109,9 @@ filesystem_t *fs_manager_remove(const char *path) {
 }
 
 void fs_manager_print() {
-  kmt->spin_lock(&lock);
-  for (fs_manager_node_t *cur = fs_manager.head; cur != NULL; cur = cur->next)
+  kmt->rcu_read_lock();
+  for (fs_manager_node_t *cur = rcu_dereference(fs_manager.head); cur != NULL;
+       cur = rcu_dereference(cur->next))
     printf("fs: %s, mounted path: %s\n", cur->fs->name, cur->path);
-  kmt->spin_unlock(&lock);
+  kmt->rcu_read_unlock();
 }
\ No newline at end of file
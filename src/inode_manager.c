@@ -1,8 +1,10 @@
 #include "os.h"
 #include "common.h"
 
+static slab_cache_t inode_cache = SLAB_CACHE_INIT("inode_cache", sizeof(inode_t));
+
 static inode_t *new_inode(const char *name, int type, int mode) {
-  inode_t *node = pmm->alloc(sizeof(inode_t));
+  inode_t *node = slab_cache_alloc(&inode_cache);
   Assert(node != NULL);
   strcpy(node->name, name);
   node->type = type;
@@ -22,7 +24,7 @@ static void delete_inode(inode_t *node) {
   }
   node->parent = node->child = node->next = node->prev = NULL;
   string_destroy(&node->data);
-  pmm->free(node);
+  slab_cache_free(&inode_cache, node);
 }
 
 static void inode_add_child(inode_t *parent, inode_t *node) {
@@ -126,7 +128,7 @@ static void inode_recursive_print(inode_t *node, int depth) {
 void inode_manager_init(inode_manager_t *inode_manager) {
   Assert(inode_manager != NULL);
   inode_manager->root = new_inode("/", INODE_DIR, DEFAULT_MODE);
-  kmt->spin_init(&inode_manager->lock, "inode_manager_lock");
+  kmt->rwlock_init(&inode_manager->lock, "inode_manager_lock", 1);
 }
 
 void inode_manager_destroy(inode_manager_t *inode_manager) {
@@ -139,76 +141,91 @@ inode_t *inode_manager_lookup(inode_manager_t *inode_manager, const char *path,
                               int type, int create, int mode) {
   Assert(inode_manager != NULL);
   Assert(path != NULL);
-  kmt->spin_lock(&inode_manager->lock);
+  // only a lookup that may create changes the tree
+  if (create)
+    kmt->write_lock(&inode_manager->lock);
+  else
+    kmt->read_lock(&inode_manager->lock);
   inode_t *ret = inode_lookup(inode_manager->root, path, type, create, mode);
-  kmt->spin_unlock(&inode_manager->lock);
+  if (create)
+    kmt->write_unlock(&inode_manager->lock);
+  else
+    kmt->read_unlock(&inode_manager->lock);
   return ret;
 }
 
 void inode_manager_remove(inode_manager_t *inode_manager, inode_t *inode) {
   Assert(inode_manager != NULL);
   Assert(inode != NULL);
-  kmt->spin_lock(&inode_manager->lock);
+  kmt->write_lock(&inode_manager->lock);
   inode_remove(inode);
   delete_inode(inode);
-  kmt->spin_unlock(&inode_manager->lock);
+  kmt->write_unlock(&inode_manager->lock);
 }
 
 void inode_manager_print(inode_manager_t *inode_manager) {
   Assert(inode_manager != NULL);
-  kmt->spin_lock(&inode_manager->lock);
+  kmt->read_lock(&inode_manager->lock);
   inode_recursive_print(inode_manager->root, 0);
-  kmt->spin_unlock(&inode_manager->lock);
+  kmt->read_unlock(&inode_manager->lock);
 }
 
 int inode_manager_checkmode(inode_manager_t *inode_manager, inode_t *inode, int mode) {
   Assert(inode_manager != NULL);
   Assert(inode != NULL);
   Assert((mode & ~R_OK & ~W_OK & ~X_OK) == 0);
-  kmt->spin_lock(&inode_manager->lock);
+  kmt->read_lock(&inode_manager->lock);
   int perm = inode->mode;
   if ((mode & R_OK) && !(perm & S_IRUSR)) {
-    kmt->spin_unlock(&inode_manager->lock);
+    kmt->read_unlock(&inode_manager->lock);
     return 0;
   }
   if ((mode & W_OK) && !(perm & S_IWUSR)) {
-    kmt->spin_unlock(&inode_manager->lock);
+    kmt->read_unlock(&inode_manager->lock);
     return 0;
   }
   if ((mode & X_OK) && !(perm & S_IXUSR)) {
-    kmt->spin_unlock(&inode_manager->lock);
+    kmt->read_unlock(&inode_manager->lock);
     return 0;
   }
-  kmt->spin_unlock(&inode_manager->lock);
+  kmt->read_unlock(&inode_manager->lock);
   return 1;
 }
 
+// inode data is a string_t, which locks itself, so the
+// calls below only need the tree to stay put
 size_t inode_manager_get_filesize(inode_manager_t *inode_manager, inode_t *inode) {
-  kmt->spin_lock(&inode_manager->lock);
+  kmt->read_lock(&inode_manager->lock);
   size_t filesize = string_length(&inode->data);
-  kmt->spin_unlock(&inode_manager->lock);
+  kmt->read_unlock(&inode_manager->lock);
   return filesize;
 }
 
 ssize_t inode_manager_read(inode_manager_t *inode_manager, inode_t *inode,
                            off_t offset, void *buf, size_t size) {
-  kmt->spin_lock(&inode_manager->lock);
+  kmt->read_lock(&inode_manager->lock);
   ssize_t nread = string_read(&inode->data, offset, buf, size);
-  kmt->spin_unlock(&inode_manager->lock);
+  kmt->read_unlock(&inode_manager->lock);
   return nread;
 }
 
 ssize_t inode_manager_write(inode_manager_t *inode_manager, inode_t *inode,
                             off_t offset, const void *buf, size_t size) {
-  kmt->spin_lock(&inode_manager->lock);
+  kmt->read_lock(&inode_manager->lock);
   ssize_t nwritten = string_write(&inode->data, offset, buf, size);
-  kmt->spin_unlock(&inode_manager->lock);
+  kmt->read_unlock(&inode_manager->lock);
   return nwritten;
 }
 
 int inode_manager_cmp_name(inode_manager_t *inode_manager, inode_t *inode, const char *name) {
-  kmt->spin_lock(&inode_manager->lock);
+  kmt->read_lock(&inode_manager->lock);
   int ret = strcmp(inode->name, name);
-  kmt->spin_unlock(&inode_manager->lock);
+  kmt->read_unlock(&inode_manager->lock);
   return ret;
 }
+
+void inode_manager_truncate(inode_manager_t *inode_manager, inode_t *inode) {
+  kmt->read_lock(&inode_manager->lock);
+  string_clear(&inode->data);
+  kmt->read_unlock(&inode_manager->lock);
+}
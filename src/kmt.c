@@ -1,9 +1,15 @@
 #include <os.h>
 #include <common.h>
+#include <amdevutil.h>
 
 static void kmt_init();
 static int kmt_create(thread_t *thread, void (*entry)(void *arg), void *arg);
+static int kmt_create_attr(thread_t *thread, const thread_attr_t *attr,
+                           void (*entry)(void *arg), void *arg);
 static void kmt_teardown(thread_t *thread);
+static int kmt_set_priority(thread_t *thread, int priority);
+static int kmt_set_tickets(thread_t *thread, int tickets);
+static int kmt_wait_period();
 static thread_t *kmt_schedule();
 static void kmt_spin_init(spinlock_t *lk, const char *name);
 static void kmt_spin_lock(spinlock_t *lk);
@@ -11,11 +17,31 @@ static void kmt_spin_unlock(spinlock_t *lk);
 static void kmt_sem_init(sem_t *sem, const char *name, int value);
 static void kmt_sem_wait(sem_t *sem);
 static void kmt_sem_signal(sem_t *sem);
+static void kmt_mutex_init(mutex_t *mutex, const char *name);
+static void kmt_mutex_lock(mutex_t *mutex);
+static void kmt_mutex_unlock(mutex_t *mutex);
+static void kmt_rwlock_init(rwlock_t *lk, const char *name, int sleepable);
+static void kmt_read_lock(rwlock_t *lk);
+static void kmt_read_unlock(rwlock_t *lk);
+static void kmt_write_lock(rwlock_t *lk);
+static void kmt_write_unlock(rwlock_t *lk);
+static void kmt_rcu_read_lock();
+static void kmt_rcu_read_unlock();
+static void kmt_synchronize_rcu();
+static void kmt_cond_init(cond_t *cond, const char *name);
+static void kmt_cond_wait(cond_t *cond, mutex_t *mutex);
+static void kmt_cond_signal(cond_t *cond);
+static void kmt_cond_broadcast(cond_t *cond);
+static void waitqueue_cancel(thread_t *thread);
 
 MOD_DEF(kmt) {
   .init = kmt_init,
   .create = kmt_create,
+  .create_attr = kmt_create_attr,
   .teardown = kmt_teardown,
+  .set_priority = kmt_set_priority,
+  .set_tickets = kmt_set_tickets,
+  .wait_period = kmt_wait_period,
   .schedule = kmt_schedule,
   .spin_init = kmt_spin_init,
   .spin_lock = kmt_spin_lock,
@@ -23,25 +49,111 @@ MOD_DEF(kmt) {
   .sem_init = kmt_sem_init,
   .sem_wait = kmt_sem_wait,
   .sem_signal = kmt_sem_signal,
+  .mutex_init = kmt_mutex_init,
+  .mutex_lock = kmt_mutex_lock,
+  .mutex_unlock = kmt_mutex_unlock,
+  .rwlock_init = kmt_rwlock_init,
+  .read_lock = kmt_read_lock,
+  .read_unlock = kmt_read_unlock,
+  .write_lock = kmt_write_lock,
+  .write_unlock = kmt_write_unlock,
+  .rcu_read_lock = kmt_rcu_read_lock,
+  .rcu_read_unlock = kmt_rcu_read_unlock,
+  .synchronize_rcu = kmt_synchronize_rcu,
+  .cond_init = kmt_cond_init,
+  .cond_wait = kmt_cond_wait,
+  .cond_signal = kmt_cond_signal,
+  .cond_broadcast = kmt_cond_broadcast,
 };
 
 /*------------------------------------------
                     thread
   ------------------------------------------*/
 
+static slab_cache_t thread_cache = SLAB_CACHE_INIT("thread_cache", sizeof(thread_t));
+
+// A tid is taken from a bitmap, searching on from the last one
+// handed out, so a freed tid is not reused right away.
+#define MAX_TID 65536
+
+static spinlock_t tid_lock = SPINLOCK_INIT("tid_lock");
+static uint32_t tid_bitmap[MAX_TID / 32];
+static int last_tid = -1;
+
+static int tid_alloc() {
+  kmt->spin_lock(&tid_lock);
+  int tid = (last_tid + 1) % MAX_TID;
+  for (int n = 0; n < MAX_TID; ) {
+    uint32_t *word = &tid_bitmap[tid / 32];
+    if (*word == 0xffffffff) {
+      // skip a full word
+      n += 32 - tid % 32;
+      tid = (tid - tid % 32 + 32) % MAX_TID;
+    } else if (*word & (1u << (tid % 32))) {
+      n++;
+      tid = (tid + 1) % MAX_TID;
+    } else {
+      *word |= 1u << (tid % 32);
+      last_tid = tid;
+      kmt->spin_unlock(&tid_lock);
+      return tid;
+    }
+  }
+  Panic("Too many threads");
+  return -1;
+}
+
+static void tid_free(int tid) {
+  kmt->spin_lock(&tid_lock);
+  tid_bitmap[tid / 32] &= ~(1u << (tid % 32));
+  kmt->spin_unlock(&tid_lock);
+}
+
+// a stride thread's pass grows by STRIDE1 / tickets every tick
+#define STRIDE1 (1 << 20)
+
+// NULL when the thread or its stack can't be allocated
 thread_t *new_thread(void (*entry)(void *), void *arg) {
-  static int tid = 0;
-  
-  thread_t *thread = (thread_t *)pmm->alloc(sizeof(thread_t));
+  thread_t *thread = (thread_t *)slab_cache_alloc(&thread_cache);
+  if (thread == NULL)
+    return NULL;
+  uint8_t *kstack = (uint8_t *)pmm->alloc_pages(KSTACK_ORDER);
+  if (kstack == NULL) {
+    slab_cache_free(&thread_cache, thread);
+    return NULL;
+  }
 
-  // tid, stat, timeslice, next
-  thread->tid = tid++;
+  // tid, stat, timeslice, cpu, scheduling and run queue state, arena, next
+  thread->tid = tid_alloc();
   thread->stat = RUNNABLE; 
   thread->timeslice = MAX_TIMESLICE;
+  thread->oncpu = 0;
+  thread->cpu = -1;
+  thread->last_cpu = 0;
+  thread->policy = SCHED_MLFQ;
+  thread->prio = thread->level = 0;
+  thread->tickets = DEFAULT_TICKETS;
+  thread->stride = STRIDE1 / DEFAULT_TICKETS;
+  thread->pass = 0;
+  thread->ticks = thread->start_ticks = 0;
+  thread->period = thread->budget = 0;
+  thread->release = thread->deadline = 0;
+  thread->rt_used = thread->rt_start = 0;
+  thread->rt_waiting = 0;
+  thread->rt_next = NULL;
+  thread->wake_tsc = 0;
+  thread->wq = NULL;
+  thread->wq_lock = NULL;
+  thread->wq_prev = thread->wq_next = NULL;
+  thread->queued = 0;
+  thread->rq_cpu = -1;
+  thread->rq_list = 0;
+  thread->rq_prev = thread->rq_next = NULL;
+  thread->arena = NULL;
   thread->next = NULL;  
 
-  // allocate stack and prepare RegSet
-  thread->kstack = (uint8_t *)pmm->alloc(MAX_KSTACK_SIZE);
+  // prepare RegSet on the stack
+  thread->kstack = kstack;
 
   _Area stackinfo;
 #ifdef DEBUG
@@ -75,98 +187,589 @@ thread_t *new_thread(void (*entry)(void *), void *arg) {
 
 void delete_thread(thread_t *thread) {
   thread->stat = DEAD;
-  pmm->free(thread->kstack);
-  pmm->free(thread);
+#ifdef DEBUG
+  pmm->free_pages(thread->kstack - FENCESIZE);
+#else
+  pmm->free_pages(thread->kstack);
+#endif
+  if (thread->arena != NULL)
+    arena_destroy(thread->arena);
+  tid_free(thread->tid);
+  slab_cache_free(&thread_cache, thread);
 }
 
 /*------------------------------------------
-                  threadlist
+                 threadtable
   ------------------------------------------*/
 
-// threadlist is THREAD SAFE
-static spinlock_t threadlist_lock = SPINLOCK_INIT("threadlist_lock");
-static thread_t *threadlist = NULL;
-thread_t *idle = NULL;
-thread_t *cur_thread = NULL;
+// threadtable is THREAD SAFE
+// Threads are hashed by tid and chained through next. Tids are
+// handed out mostly in order, so buckets stay short.
+#define NR_TID_HASH 4096
+
+static spinlock_t threadtable_lock = SPINLOCK_INIT("threadtable_lock");
+static thread_t *threadtable[NR_TID_HASH];
+struct cpu cpus[MAX_CPU];
+
+// The thread can't move to another CPU while interrupts are off.
+thread_t *current_thread() {
+  int intr = _intr_read();
+  _intr_write(0);
+  thread_t *ret = mycpu()->current;
+  _intr_write(intr);
+  return ret;
+}
 
-void threadlist_add(thread_t *thread) {
+static inline thread_t **threadtable_bucket(int tid) {
+  return &threadtable[tid & (NR_TID_HASH - 1)];
+}
+
+void threadtable_add(thread_t *thread) {
   Assert(thread != NULL);
 
-  kmt->spin_lock(&threadlist_lock);
-  if (threadlist == NULL) {
-    thread->next = threadlist = thread;
-  } else {
-    thread->next = threadlist->next;
-    threadlist->next = thread;
-  }
-  kmt->spin_unlock(&threadlist_lock);
+  kmt->spin_lock(&threadtable_lock);
+  thread_t **bucket = threadtable_bucket(thread->tid);
+  thread->next = *bucket;
+  rcu_assign_pointer(*bucket, thread);
+  kmt->spin_unlock(&threadtable_lock);
 }
 
-thread_t *threadlist_remove(int tid) {
-  Assert(threadlist != NULL);
-  thread_t *prev, *cur;
+thread_t *threadtable_remove(int tid) {
+  thread_t **link;
 
-  kmt->spin_lock(&threadlist_lock);
-  prev = threadlist;
-  for (cur = prev->next; ; prev = cur, cur = cur->next) {
-    if (cur->tid == tid)
+  kmt->spin_lock(&threadtable_lock);
+  for (link = threadtable_bucket(tid); *link != NULL; link = &(*link)->next)
+    if ((*link)->tid == tid)
       break;
-    if (cur == threadlist)
-      Panic("No thread in list to remove!");
+  if (*link == NULL)
+    Panic("No thread in table to remove!");
+  thread_t *ret = *link;
+  // readers may still be on ret, leave its next alone
+  rcu_assign_pointer(*link, ret->next);
+  kmt->spin_unlock(&threadtable_lock);
+
+  return ret;
+}
+
+// Under rcu_read_lock or threadtable_lock. Threads are freed
+// only a grace period after they leave the table.
+static thread_t *threadtable_lookup(int tid) {
+  for (thread_t *scan = rcu_dereference(*threadtable_bucket(tid));
+       scan != NULL; scan = rcu_dereference(scan->next))
+    if (scan->tid == tid)
+      return scan;
+  return NULL;
+}
+
+void threadtable_print() {
+  kmt->rcu_read_lock();
+  for (int i = 0; i < NR_TID_HASH; ++i) {
+    for (thread_t *scan = rcu_dereference(threadtable[i]); scan != NULL;
+         scan = rcu_dereference(scan->next)) {
+      const char *stat = NULL;
+      switch (scan->stat) {
+        case RUNNING: stat = "RUNNING"; break;
+        case RUNNABLE: stat = "RUNNABLE"; break;
+        case BLOCKED: stat = "BLOCKED"; break;
+        case DEAD: stat = "DEAD"; break;
+        default: Panic("Should not reach here");
+      }
+      printf("(tid: %d, stat: %s, level: %d, slice: %d)\n", 
+        scan->tid, stat, scan->level, scan->timeslice);
+    }
   }
-  prev->next = cur->next;
-  kmt->spin_unlock(&threadlist_lock);
+  kmt->rcu_read_unlock();
+}
+
+/*------------------------------------------
+                  run queue
+  ------------------------------------------*/
+
+// Every CPU has a queue of RUNNABLE threads and picks from it
+// without touching other CPUs. An idle CPU steals from the
+// others, and every BALANCE_TICKS ticks a CPU pulls a thread
+// from the busiest queue if that one is clearly longer.
+//
+// A thread may stay queued while it runs or while its stack is
+// still in use (oncpu), pickers skip it then. Threads that are
+// no longer RUNNABLE when picked are dropped from the queue.
+//
+// EDF threads are served first, from a list sorted by deadline.
+//
+// Stride threads are next, from a list sorted by pass: the one
+// that has had the least CPU for its tickets runs next. A thread
+// joining the list starts no earlier than the queue's pass, so
+// sleeping does not build up credit. The stride class gets at
+// most STRIDE_LIMIT of every STRIDE_WINDOW ticks of a CPU while
+// MLFQ threads wait there, after that its list comes last.
+//
+// Then comes a multilevel feedback queue: one list per level,
+// served from level 0. A thread that uses up its quantum drops
+// a level and gets a quantum twice as long. Waking up, and a
+// boost every BOOST_TICKS ticks, lift it back to its priority.
+#define BALANCE_TICKS 8
+#define BOOST_TICKS   100
+#define STRIDE_WINDOW 10
+#define STRIDE_LIMIT  8
+
+#define EDF_LIST      0
+#define STRIDE_LIST   1
+#define MLFQ_LIST(level) ((level) + 2)
+#define NR_LISTS      MLFQ_LIST(NR_PRIO)
+
+#define quantum(level) (MAX_TIMESLICE << (level))
 
-  return cur;
+// uptime() wraps around
+#define time_before(a, b) ((int32_t)((a) - (b)) < 0)
+
+static inline int thread_list(thread_t *thread) {
+  switch (thread->policy) {
+    case SCHED_EDF: return EDF_LIST;
+    case SCHED_STRIDE: return STRIDE_LIST;
+    default: return MLFQ_LIST(thread->level);
+  }
+}
+
+static inline int thread_quantum(thread_t *thread) {
+  return thread->policy == SCHED_MLFQ ? quantum(thread->level) : MAX_TIMESLICE;
+}
+
+// Order of the sorted lists.
+static inline int thread_before(thread_t *a, thread_t *b) {
+  if (a->policy == SCHED_EDF)
+    return time_before(a->deadline, b->deadline);
+  return a->pass < b->pass;
+}
+
+typedef struct runqueue {
+  spinlock_t lock;
+  thread_t *head[NR_LISTS];
+  thread_t *tail[NR_LISTS];
+  uint64_t pass;    // pass of the last stride thread picked
+  int nr;
+  int ticks;
+  int stride_ticks; // stride ticks in this window, only its CPU writes
+  int stride_start; // ticks when this window began
+  // cost of kmt_schedule, only touched by its own CPU
+  int nr_schedule;
+  uint64_t sched_cycles;
+  uint32_t max_sched_cycles;
+  // ticks spent idle, and how long woken threads waited for the
+  // CPU when it was idle
+  int idle_ticks;
+  int nr_wakeups;
+  uint64_t wakeup_cycles;
+  uint32_t max_wakeup_cycles;
+} runqueue_t;
+
+static runqueue_t runqueues[MAX_CPU];
+
+static void runqueue_init() {
+  for (int cpu = 0; cpu < MAX_CPU; ++cpu) {
+    runqueue_t *rq = &runqueues[cpu];
+    kmt_spin_init(&rq->lock, "runqueue_lock");
+    for (int list = 0; list < NR_LISTS; ++list)
+      rq->head[list] = rq->tail[list] = NULL;
+    rq->pass = 0;
+    rq->nr = rq->ticks = rq->stride_ticks = 0;
+    rq->stride_start = 0;
+    rq->nr_schedule = 0;
+    rq->sched_cycles = 0;
+    rq->max_sched_cycles = 0;
+    rq->idle_ticks = rq->nr_wakeups = 0;
+    rq->wakeup_cycles = 0;
+    rq->max_wakeup_cycles = 0;
+  }
+}
+
+// ticks of all CPUs, read without locks
+static int total_ticks() {
+  int ret = 0;
+  for (int cpu = 0; cpu < _ncpu(); ++cpu)
+    ret += runqueues[cpu].ticks;
+  return ret;
+}
+
+// Whether no CPU has anything queued, read without locks.
+static int runqueue_all_empty() {
+  for (int cpu = 0; cpu < _ncpu(); ++cpu)
+    if (runqueues[cpu].nr != 0)
+      return 0;
+  return 1;
+}
+
+static int least_loaded_cpu() {
+  int best = 0;
+  for (int cpu = 1; cpu < _ncpu(); ++cpu)
+    if (runqueues[cpu].nr < runqueues[best].nr)
+      best = cpu;
+  return best;
+}
+
+// Queue must be locked, and thread->queued owned by the caller.
+static void runqueue_link(runqueue_t *rq, thread_t *thread) {
+  int list = thread_list(thread);
+  thread_t *next = NULL;
+  if (list == STRIDE_LIST && thread->pass < rq->pass)
+    thread->pass = rq->pass;
+  if (list == EDF_LIST || list == STRIDE_LIST) {
+    next = rq->head[list];
+    while (next != NULL && !thread_before(thread, next))
+      next = next->rq_next;
+  }
+
+  // insert before next, NULL for the tail
+  thread->rq_next = next;
+  thread->rq_prev = (next != NULL ? next->rq_prev : rq->tail[list]);
+  if (thread->rq_prev != NULL)
+    thread->rq_prev->rq_next = thread;
+  else
+    rq->head[list] = thread;
+  if (next != NULL)
+    next->rq_prev = thread;
+  else
+    rq->tail[list] = thread;
+  thread->rq_cpu = rq - runqueues;
+  thread->rq_list = list;
+  rq->nr++;
 }
 
-void threadlist_print() {
-  if (threadlist == NULL) {
-    printf("Threadlist: (null)");
+// Queue must be locked.
+static void runqueue_unlink(runqueue_t *rq, thread_t *thread) {
+  int list = thread->rq_list;
+  if (thread->rq_prev != NULL)
+    thread->rq_prev->rq_next = thread->rq_next;
+  else
+    rq->head[list] = thread->rq_next;
+  if (thread->rq_next != NULL)
+    thread->rq_next->rq_prev = thread->rq_prev;
+  else
+    rq->tail[list] = thread->rq_prev;
+  thread->rq_prev = thread->rq_next = NULL;
+  thread->rq_cpu = -1;
+  rq->nr--;
+  _atomic_xchg(&thread->queued, 0);
+}
+
+// Pinned threads always go to their own CPU.
+static void runqueue_add(thread_t *thread, int cpu) {
+  if (thread->cpu >= 0)
+    cpu = thread->cpu;
+  if (_atomic_xchg(&thread->queued, 1) == 1)
     return;
+
+  runqueue_t *rq = &runqueues[cpu];
+  kmt->spin_lock(&rq->lock);
+  if (thread->stat == DEAD)
+    _atomic_xchg(&thread->queued, 0);
+  else
+    runqueue_link(rq, thread);
+  kmt->spin_unlock(&rq->lock);
+}
+
+// The i-th list to look at. A throttled stride list moves behind
+// the MLFQ lists.
+static inline int list_order(int throttled, int i) {
+  if (!throttled || i < STRIDE_LIST)
+    return i;
+  return i == NR_LISTS - 1 ? STRIDE_LIST : i + 1;
+}
+
+// Take the first thread of the first non-empty list that can run
+// on cpu and claim it. With steal set, pinned threads are left alone.
+static thread_t *runqueue_pick(int from, int cpu, int steal) {
+  runqueue_t *rq = &runqueues[from];
+  thread_t *ret = NULL;
+
+  kmt->spin_lock(&rq->lock);
+  int throttled = (rq->stride_ticks >= STRIDE_LIMIT);
+  for (int i = 0; i < NR_LISTS && ret == NULL; ++i) {
+    int list = list_order(throttled, i);
+    thread_t *scan = rq->head[list];
+    while (scan != NULL) {
+      thread_t *next = scan->rq_next;
+      if (scan->stat != RUNNABLE) {
+        runqueue_unlink(rq, scan);
+        // runqueue_add may have been skipped while it was queued
+        if (scan->stat == RUNNABLE && _atomic_xchg(&scan->queued, 1) == 0)
+          runqueue_link(rq, scan);
+      } else if (!scan->oncpu && !(steal && scan->cpu >= 0)) {
+        runqueue_unlink(rq, scan);
+        scan->stat = RUNNING;
+        scan->oncpu = 1;
+        scan->last_cpu = cpu;
+        if (list == STRIDE_LIST)
+          rq->pass = scan->pass;
+        ret = scan;
+        break;
+      }
+      scan = next;
+    }
   }
+  kmt->spin_unlock(&rq->lock);
+  return ret;
+}
+
+// Whether a thread waiting should run before thread, read without
+// the lock: one of an earlier list, or an earlier deadline.
+static int runqueue_preempts(int cpu, thread_t *thread) {
+  runqueue_t *rq = &runqueues[cpu];
+  int throttled = (rq->stride_ticks >= STRIDE_LIMIT);
+  int list = thread_list(thread);
+  for (int i = 0; list_order(throttled, i) != list; ++i)
+    if (rq->head[list_order(throttled, i)] != NULL)
+      return 1;
+  thread_t *head = rq->head[EDF_LIST];
+  return list == EDF_LIST && head != NULL && thread_before(head, thread);
+}
 
-  kmt->spin_lock(&threadlist_lock);
-  for (thread_t *scan = threadlist->next; ; scan = scan->next) {
-    const char *stat = NULL;
-    switch (scan->stat) {
-      case RUNNING: stat = "RUNNING"; break;
-      case RUNNABLE: stat = "RUNNABLE"; break;
-      case BLOCKED: stat = "BLOCKED"; break;
-      case DEAD: stat = "BLOCKED"; break;
-      default: Panic("Should not reach here");
+// Lift every queued thread back to its priority, so that threads
+// at the bottom are not starved by those that keep waking up.
+static void runqueue_boost(int cpu) {
+  runqueue_t *rq = &runqueues[cpu];
+
+  kmt->spin_lock(&rq->lock);
+  for (int level = 1; level < NR_PRIO; ++level) {
+    thread_t *scan = rq->head[MLFQ_LIST(level)];
+    while (scan != NULL) {
+      thread_t *next = scan->rq_next;
+      if (scan->prio < level) {
+        runqueue_unlink(rq, scan);
+        scan->level = scan->prio;
+        if (_atomic_xchg(&scan->queued, 1) == 0)
+          runqueue_link(rq, scan);
+      }
+      scan = next;
     }
-    printf("(tid: %d, stat: %s, slice: %d)\n", 
-      scan->tid, stat, scan->timeslice);
-    if (scan == threadlist)
-      break;
   }
-  kmt->spin_unlock(&threadlist_lock);
+  kmt->spin_unlock(&rq->lock);
+}
+
+static thread_t *runqueue_steal(int cpu) {
+  for (int i = 1; i < _ncpu(); ++i) {
+    int victim = (cpu + i) % _ncpu();
+    if (runqueues[victim].nr == 0)
+      continue;
+    thread_t *ret = runqueue_pick(victim, cpu, 1);
+    if (ret != NULL)
+      return ret;
+  }
+  return NULL;
+}
+
+// Pull one thread from the busiest queue. Queue lengths are
+// read without locks, they are only hints.
+static void runqueue_balance(int cpu) {
+  int busiest = cpu;
+  for (int i = 0; i < _ncpu(); ++i)
+    if (runqueues[i].nr > runqueues[busiest].nr)
+      busiest = i;
+  if (runqueues[busiest].nr <= runqueues[cpu].nr + 1)
+    return;
+
+  // oncpu keeps teardown away until it is queued again
+  thread_t *thread = runqueue_pick(busiest, cpu, 1);
+  if (thread != NULL) {
+    if (atomic_cmpxchg(&thread->stat, RUNNING, RUNNABLE) == RUNNING)
+      runqueue_add(thread, cpu);
+    thread->oncpu = 0;
+  }
+}
+
+/*------------------------------------------
+                  real time
+  ------------------------------------------*/
+
+// An EDF thread runs up to budget ms in every period ms. It is
+// admitted only if the utilization of its CPU stays within
+// EDF_MAX_UTIL permille and is pinned there, so admitted threads
+// meet their deadlines. A thread that waits for its next period,
+// or uses up its budget, sleeps on the release list until the
+// period starts. Every tick releases the threads that are due.
+#define EDF_MAX_UTIL 900
+
+static spinlock_t edf_lock = SPINLOCK_INIT("edf_lock");
+static thread_t *release_list = NULL;  // sorted by release
+static int edf_util[MAX_CPU];          // permille
+
+static int edf_thread_util(uint32_t period, uint32_t budget) {
+  return (budget * 1000 + period - 1) / period;
+}
+
+// Reserve utilization on cpu, or on the least used CPU if cpu is
+// -1. Return the CPU, -1 if it does not fit.
+static int edf_admit(int cpu, int period, int budget) {
+  int util = edf_thread_util(period, budget);
+  int ret = -1;
+
+  kmt->spin_lock(&edf_lock);
+  for (int i = 0; i < _ncpu(); ++i) {
+    if ((cpu >= 0 && i != cpu) || edf_util[i] + util > EDF_MAX_UTIL)
+      continue;
+    if (ret < 0 || edf_util[i] < edf_util[ret])
+      ret = i;
+  }
+  if (ret >= 0)
+    edf_util[ret] += util;
+  kmt->spin_unlock(&edf_lock);
+  return ret;
+}
+
+// Start the period at thread->release, or at now if the thread
+// is behind by more than a period.
+static void edf_new_period(thread_t *thread, uint32_t now) {
+  if (time_before(thread->release + thread->period, now))
+    thread->release = now;
+  thread->deadline = thread->release + thread->period;
+  thread->release = thread->deadline;
+  thread->rt_used = 0;
+}
+
+// edf_lock must be held.
+static void edf_sleep(thread_t *thread) {
+  thread_t **link = &release_list;
+  while (*link != NULL && !time_before(thread->release, (*link)->release))
+    link = &(*link)->rt_next;
+  thread->rt_next = *link;
+  *link = thread;
+  thread->rt_waiting = 1;
+}
+
+// edf_lock must be held.
+static void edf_cancel(thread_t *thread) {
+  thread_t **link = &release_list;
+  while (*link != thread)
+    link = &(*link)->rt_next;
+  *link = thread->rt_next;
+  thread->rt_next = NULL;
+  thread->rt_waiting = 0;
+}
+
+// Release the threads whose period has started. The list is
+// read without the lock first, it is only a hint.
+static void edf_release() {
+  if (release_list == NULL)
+    return;
+  uint32_t now = uptime();
+
+  kmt->spin_lock(&edf_lock);
+  while (release_list != NULL && !time_before(now, release_list->release)) {
+    thread_t *thread = release_list;
+    edf_cancel(thread);
+    edf_new_period(thread, now);
+    thread->wake_tsc = rdtsc();
+    if (atomic_cmpxchg(&thread->stat, BLOCKED, RUNNABLE) == BLOCKED)
+      runqueue_add(thread, thread->cpu);
+  }
+  kmt->spin_unlock(&edf_lock);
+}
+
+// Charge the running thread, and throttle it once its budget is
+// used up.
+static void edf_charge(thread_t *thread) {
+  uint32_t now = uptime();
+  thread->rt_used += now - thread->rt_start;
+  thread->rt_start = now;
+  if (thread->rt_used < thread->budget)
+    return;
+
+  kmt->spin_lock(&edf_lock);
+  if (atomic_cmpxchg(&thread->stat, RUNNING, BLOCKED) == RUNNING)
+    edf_sleep(thread);
+  kmt->spin_unlock(&edf_lock);
+}
+
+// The thread is no longer running on any CPU.
+// give back a reservation whose thread was never created
+static void edf_unadmit(int cpu, int period, int budget) {
+  kmt->spin_lock(&edf_lock);
+  edf_util[cpu] -= edf_thread_util(period, budget);
+  kmt->spin_unlock(&edf_lock);
+}
+
+static void edf_remove(thread_t *thread) {
+  kmt->spin_lock(&edf_lock);
+  if (thread->rt_waiting)
+    edf_cancel(thread);
+  edf_util[thread->cpu] -= edf_thread_util(thread->period, thread->budget);
+  kmt->spin_unlock(&edf_lock);
 }
 
 /*------------------------------------------
                thread manager
   ------------------------------------------*/
 
+// Halt until the next interrupt, then the tick decides.
 static void IDLE(void *arg) {
   while (1) {
-    continue;
+    hlt();
   }
 }
 
 static void kmt_init() {
-  // create IDLE thread
-  // we will not add idle to threadlist
-  idle = new_thread(IDLE, NULL);
+  runqueue_init();
+
+  // create an IDLE thread for every CPU
+  // we will not add idle to threadtable
+  Assert(_ncpu() <= MAX_CPU);
+  for (int cpu = 0; cpu < _ncpu(); ++cpu) {
+    cpus[cpu].idle = new_thread(IDLE, NULL);
+    Assert(cpus[cpu].idle != NULL);
+    cpus[cpu].idle->cpu = cpu;
+  }
 }
 
 static int kmt_create(thread_t *thread,
   void (*entry)(void *arg), void *arg) {
+  thread_attr_t attr = THREAD_ATTR_INIT;
+  return kmt_create_attr(thread, &attr, entry, arg);
+}
+
+static int kmt_create_attr(thread_t *thread, const thread_attr_t *attr,
+  void (*entry)(void *arg), void *arg) {
+
+  if (attr->policy != SCHED_MLFQ && attr->policy != SCHED_STRIDE &&
+      attr->policy != SCHED_EDF)
+    return -1;
+  if (attr->priority < 0 || attr->priority >= NR_PRIO)
+    return -1;
+  if (attr->tickets <= 0 || attr->tickets > MAX_TICKETS)
+    return -1;
+
+  int cpu = attr->pin_cpu;
+  if (cpu < 0 || cpu >= _ncpu())
+    cpu = -1;
+  if (attr->policy == SCHED_EDF) {
+    if (attr->budget <= 0 || attr->budget > attr->period)
+      return -1;
+    // admission control
+    cpu = edf_admit(cpu, attr->period, attr->budget);
+    if (cpu < 0)
+      return -1;
+  }
 
   thread_t *new_thr = new_thread(entry, arg);
+  if (new_thr == NULL) {
+    if (attr->policy == SCHED_EDF)
+      edf_unadmit(cpu, attr->period, attr->budget);
+    return -1;
+  }
+  new_thr->cpu = cpu;
+  new_thr->policy = attr->policy;
+  new_thr->prio = new_thr->level = attr->priority;
+  new_thr->tickets = attr->tickets;
+  new_thr->stride = STRIDE1 / attr->tickets;
+  new_thr->start_ticks = total_ticks();
+  if (attr->policy == SCHED_EDF) {
+    new_thr->period = attr->period;
+    new_thr->budget = attr->budget;
+    new_thr->release = uptime();
+    edf_new_period(new_thr, new_thr->release);
+  }
   
   // add thread to list
-  threadlist_add(new_thr);
+  threadtable_add(new_thr);
+  runqueue_add(new_thr, least_loaded_cpu());
 
   // add thread info to procfs
   filesystem_t *procfs = fs_manager_get("/proc", NULL);
@@ -176,6 +779,7 @@ static int kmt_create(thread_t *thread,
   strcat(content, number);
   strcat(content, " say hello to you!");
   procfs_add_procinfo(procfs, new_thr->tid, "hello", content, strlen(content));
+  procfs_add_thread(procfs, new_thr->tid);
   
   // only return tid to user
   memset(thread, 0, sizeof(thread_t));
@@ -193,104 +797,413 @@ static void kmt_teardown(thread_t *thread) {
   Assert(thread->kstack == NULL);
   Assert(thread->next == NULL);
 
-  thread_t *thr = threadlist_remove(thread->tid);
+  thread_t *thr = threadtable_remove(thread->tid);
+  filesystem_t *procfs = fs_manager_get("/proc", NULL);
+  procfs_remove_procinfo(procfs, thr->tid);
+
+  // With every run queue locked, no CPU is picking the thread.
+  // It is never queued or claimed again once it is DEAD.
+  for (int cpu = 0; cpu < _ncpu(); ++cpu)
+    kmt->spin_lock(&runqueues[cpu].lock);
+  _atomic_xchg(&thr->stat, DEAD);
+  if (thr->rq_cpu >= 0)
+    runqueue_unlink(&runqueues[thr->rq_cpu], thr);
+  for (int cpu = _ncpu() - 1; cpu >= 0; --cpu)
+    kmt->spin_unlock(&runqueues[cpu].lock);
+
+  // it may still be running on another CPU
+  while (thr->oncpu)
+    _yield();
+  if (thr->policy == SCHED_EDF)
+    edf_remove(thr);
+  waitqueue_cancel(thr);
+  // lookups that found it before it left the table are done
+  kmt->synchronize_rcu();
   delete_thread(thr);
 }
 
-static thread_t *kmt_schedule() {
-  // threadlist_print();
-  Assert(cur_thread != NULL);
-  thread_t *scan;
+// The new priority takes effect the next time it is queued.
+static int kmt_set_priority(thread_t *thread, int priority) {
+  if (priority < 0 || priority >= NR_PRIO)
+    return -1;
 
-  // Case 1: cur_thread is idle thread
-  if (cur_thread == idle) {
+  kmt->rcu_read_lock();
+  thread_t *thr = threadtable_lookup(thread->tid);
+  if (thr != NULL)
+    thr->prio = thr->level = priority;
+  kmt->rcu_read_unlock();
+  return thr != NULL ? 0 : -1;
+}
 
-    if (threadlist == NULL) 
-      return idle;
+// The new share takes effect from the next tick.
+static int kmt_set_tickets(thread_t *thread, int tickets) {
+  if (tickets <= 0 || tickets > MAX_TICKETS)
+    return -1;
 
-    kmt->spin_lock(&threadlist_lock);
-    for (scan = threadlist->next; ; scan = scan->next) {
-      Assert(scan != NULL);
-      if (scan->stat == RUNNABLE) {
-#ifdef DEBUG_SCHEDULE
-        Log("Next thread (tid %d)", scan->tid);
-#endif 
-        kmt->spin_unlock(&threadlist_lock);
-        return scan;
-      }
-      if (scan == threadlist->next) {
-        kmt->spin_unlock(&threadlist_lock);
-        return idle;
-      }
+  kmt->rcu_read_lock();
+  thread_t *thr = threadtable_lookup(thread->tid);
+  if (thr != NULL) {
+    thr->tickets = tickets;
+    thr->stride = STRIDE1 / tickets;
+  }
+  kmt->rcu_read_unlock();
+  return thr != NULL ? 0 : -1;
+}
+
+// Sleep until the next period of the EDF thread starts, return
+// -1 at once for other threads.
+static int kmt_wait_period() {
+  thread_t *cur = current_thread();
+  if (cur->policy != SCHED_EDF)
+    return -1;
+  uint32_t now = uptime();
+
+  kmt->spin_lock(&edf_lock);
+  if (!time_before(now, cur->release)) {
+    // missed the start, run the next period now
+    edf_new_period(cur, now);
+    kmt->spin_unlock(&edf_lock);
+    return 0;
+  }
+  if (atomic_cmpxchg(&cur->stat, RUNNING, BLOCKED) == RUNNING)
+    edf_sleep(cur);
+  kmt->spin_unlock(&edf_lock);
+  _yield();
+  return 0;
+}
+
+// The thread returned is claimed for this CPU: it is marked
+// RUNNING and oncpu, so that no other CPU can pick it.
+// Only the local queue is looked at unless it is empty, and
+// it holds no BLOCKED threads, so this does not depend on the
+// number of threads.
+static thread_t *pick_next(struct cpu *cpu, int id) {
+  thread_t *cur = cpu->current;
+  Assert(cur != NULL);
+  thread_t *next = NULL;
+
+  runqueue_t *rq = &runqueues[id];
+  // An idle CPU with nothing to do anywhere leaves the tick at
+  // once. AM has no one-shot timer to stop the tick altogether.
+  if (cur == cpu->idle && release_list == NULL && runqueue_all_empty()) {
+    rq->ticks++;
+    rq->idle_ticks++;
+    return cur;
+  }
+
+  edf_release();
+  if (++rq->ticks % BALANCE_TICKS == 0)
+    runqueue_balance(id);
+  // idle ticks return early, so a window may have ended long ago
+  if (rq->ticks - rq->stride_start >= STRIDE_WINDOW) {
+    rq->stride_start = rq->ticks;
+    rq->stride_ticks = 0;
+  }
+  if (rq->ticks % BOOST_TICKS == 0) {
+    runqueue_boost(id);
+    cur->level = cur->prio;
+  }
+
+  if (cur != cpu->idle) {
+    cur->ticks++;
+    if (cur->policy == SCHED_STRIDE) {
+      cur->pass += cur->stride;
+      rq->stride_ticks++;
     }
-    Panic("Should not reach here!");
-    kmt->spin_unlock(&threadlist_lock);
+    if (cur->policy == SCHED_EDF)
+      edf_charge(cur);
+
+    atomic_cmpxchg(&cur->stat, RUNNING, RUNNABLE);
+    // cur_thread can continue unless a waiting thread comes first
+    if (cur->timeslice > 0 && !runqueue_preempts(id, cur) &&
+        atomic_cmpxchg(&cur->stat, RUNNABLE, RUNNING) == RUNNABLE)
+      return cur;
+    // used up its quantum
+    if (cur->timeslice <= 0 && cur->policy == SCHED_MLFQ &&
+        cur->level < NR_PRIO - 1)
+      cur->level++;
+    if (cur->stat == RUNNABLE)
+      runqueue_add(cur, id);
   }
-  
-  // Case 2: cur_thread is in threadlist
 
-  // cur_thread can continue
-  if (cur_thread->stat == RUNNABLE && cur_thread->timeslice > 0)
-    return cur_thread;
+  next = runqueue_pick(id, id, 0);
+  if (next == NULL)
+    next = runqueue_steal(id);
+  if (next == NULL) {
+    // nothing else to run
+    if (cur != cpu->idle &&
+        atomic_cmpxchg(&cur->stat, RUNNABLE, RUNNING) == RUNNABLE)
+      next = cur;
+    else
+      next = cpu->idle;
+  }
+
+  if (next->timeslice <= 0)
+    next->timeslice = thread_quantum(next);
+  if (next->policy == SCHED_EDF && next != cur)
+    next->rt_start = uptime();
+  if (cur == cpu->idle && next == cur)
+    rq->idle_ticks++;
+  if (next->wake_tsc != 0) {
+    if (cur == cpu->idle) {
+      uint32_t cycles = (uint32_t)(rdtsc() - next->wake_tsc);
+      rq->nr_wakeups++;
+      rq->wakeup_cycles += cycles;
+      if (cycles > rq->max_wakeup_cycles)
+        rq->max_wakeup_cycles = cycles;
+    }
+    next->wake_tsc = 0;
+  }
+  next->oncpu = 1;
+  return next;
+}
+
+static thread_t *kmt_schedule() {
+  // threadtable_print();
+  uint64_t start = rdtsc();
+  int id = _cpu();
+  thread_t *next = pick_next(mycpu(), id);
+  mycpu()->rcu_qs++;
+
+  runqueue_t *rq = &runqueues[id];
+  uint32_t cycles = (uint32_t)(rdtsc() - start);
+  rq->nr_schedule++;
+  rq->sched_cycles += cycles;
+  if (cycles > rq->max_sched_cycles)
+    rq->max_sched_cycles = cycles;
 
-  // Round-Robin
-  kmt->spin_lock(&threadlist_lock);
-  for (scan = cur_thread->next; ; scan = scan->next) {
-    Assert(scan != NULL);
-    if (scan->stat == RUNNABLE) {
 #ifdef DEBUG_SCHEDULE
-      Log("Next thread (tid %d)", scan->tid);
+  Log("Next thread (tid %d) on cpu %d", next->tid, id);
 #endif
-      kmt->spin_unlock(&threadlist_lock);
-      return scan;
-    }
-    // if no thread can run, schedule to idle
-    if (scan == cur_thread) {
-      kmt->spin_unlock(&threadlist_lock);
-      return idle;
-    }
+  return next;
+}
+
+// avoid 64-bit division
+static uint32_t avg_cycles(uint64_t total, int n) {
+  return n == 0 ? 0 : (uint32_t)(total >> 8) / n << 8;
+}
+
+void schedstat_render(string_t *out) {
+  char line[160];
+  string_cat(out, "cpu    runnable    schedules  avg_cycles  max_cycles"
+                  "  idle_ticks     wakeups    avg_wake    max_wake\n");
+  for (int cpu = 0; cpu < _ncpu(); ++cpu) {
+    runqueue_t *rq = &runqueues[cpu];
+    sprintf(line, "%3d %11d %12d %11d %11d %11d %11d %11d %11d\n",
+      cpu, rq->nr, rq->nr_schedule,
+      avg_cycles(rq->sched_cycles, rq->nr_schedule), rq->max_sched_cycles,
+      rq->idle_ticks, rq->nr_wakeups,
+      avg_cycles(rq->wakeup_cycles, rq->nr_wakeups), rq->max_wakeup_cycles);
+    string_cat(out, line);
   }
-  Panic("Should not reach here!");
-  return idle;
+}
+
+// Share is in permille of all CPUs since the thread was created.
+void thread_sched_render(int tid, string_t *out) {
+  // take a snapshot first, string_cat allocates memory
+  kmt->rcu_read_lock();
+  thread_t *thr = threadtable_lookup(tid);
+  if (thr == NULL) {
+    kmt->rcu_read_unlock();
+    return;
+  }
+  int policy = thr->policy, prio = thr->prio, level = thr->level;
+  int tickets = thr->tickets, ticks = thr->ticks;
+  int period = thr->period, budget = thr->budget;
+  int elapsed = total_ticks() - thr->start_ticks;
+  kmt->rcu_read_unlock();
+
+  // ticks never exceeds elapsed, keep ticks * 1000 in range
+  int share = 0;
+  if (elapsed > 2000000)
+    share = ticks / (elapsed / 1000);
+  else if (elapsed > 0)
+    share = ticks * 1000 / elapsed;
+
+  char line[128];
+  const char *name = (policy == SCHED_EDF ? "edf" :
+                      policy == SCHED_STRIDE ? "stride" : "mlfq");
+  sprintf(line, "Policy:   %s\n", name);
+  string_cat(out, line);
+  if (policy == SCHED_EDF) {
+    sprintf(line, "Period:   %d ms\nBudget:   %d ms\n", period, budget);
+    string_cat(out, line);
+  }
+  sprintf(line, "Priority: %d\nLevel:    %d\n", prio, level);
+  string_cat(out, line);
+  sprintf(line, "Tickets:  %d\n", tickets);
+  string_cat(out, line);
+  sprintf(line, "Ticks:    %d\nShare:    %d permille\n", ticks, share);
+  string_cat(out, line);
 }
 
 /*------------------------------------------
                   spin lock
   ------------------------------------------*/
 
+// Waiting spins pause this many times per thread ahead in line,
+// so waiters far back leave the lock's cache line alone.
+#define SPIN_BACKOFF 32
+
 static void kmt_spin_init(spinlock_t *lk, const char *name) {
-  lk->locked = 0;
+  lk->next = lk->owner = 0;
   lk->name = name;
+  lk->acquired = 0;
 }
 
-static int nintr = 0;
-static int intr_save;
+#ifdef DEBUG_LOCKSTAT
+// Statistics are kept per lock name, so all the locks of a kind
+// share a row. Every CPU updates its own table with interrupts
+// off, and the tables are merged when rendered.
+#define NR_LOCKSTAT 256
+
+typedef struct lockstat {
+  const char *name;
+  int nr_acquired;
+  int nr_contended;
+  uint64_t wait_cycles;
+  uint32_t max_wait_cycles;
+  uint64_t hold_cycles;
+  uint32_t max_hold_cycles;
+} lockstat_t;
+
+static lockstat_t lockstats[MAX_CPU][NR_LOCKSTAT];
+
+// Names are hashed by address, NULL if the table is full.
+static lockstat_t *lockstat_get(const char *name) {
+  lockstat_t *table = lockstats[_cpu()];
+  int i = ((uintptr_t)name >> 2) % NR_LOCKSTAT;
+  for (int n = 0; n < NR_LOCKSTAT; ++n, i = (i + 1) % NR_LOCKSTAT) {
+    if (table[i].name == NULL)
+      table[i].name = name;
+    if (table[i].name == name)
+      return &table[i];
+  }
+  return NULL;
+}
+
+static void lockstat_acquired(spinlock_t *lk, uint64_t start, int contended) {
+  lk->acquired = rdtsc();
+  lockstat_t *stat = (lk->name != NULL ? lockstat_get(lk->name) : NULL);
+  if (stat == NULL)
+    return;
+  uint32_t wait = (uint32_t)(lk->acquired - start);
+  stat->nr_acquired++;
+  stat->nr_contended += contended;
+  stat->wait_cycles += wait;
+  if (wait > stat->max_wait_cycles)
+    stat->max_wait_cycles = wait;
+}
+
+static void lockstat_released(spinlock_t *lk) {
+  uint32_t hold = (uint32_t)(rdtsc() - lk->acquired);
+  lockstat_t *stat = (lk->name != NULL ? lockstat_get(lk->name) : NULL);
+  if (stat == NULL)
+    return;
+  stat->hold_cycles += hold;
+  if (hold > stat->max_hold_cycles)
+    stat->max_hold_cycles = hold;
+}
+
+// Rows are sorted by total wait. Cycle totals are in units of
+// 1024 cycles.
+void lockstat_render(string_t *out) {
+  int nrows = 0, max_rows = NR_LOCKSTAT * _ncpu();
+  lockstat_t *rows = arena_alloc(thread_arena(), sizeof(lockstat_t) * max_rows);
+  char *buf = arena_alloc(thread_arena(), 128);
+  if (rows == NULL || buf == NULL)
+    return;
+
+  // the tables are read without locks, numbers may be a bit off
+  for (int cpu = 0; cpu < _ncpu(); ++cpu) {
+    for (int i = 0; i < NR_LOCKSTAT; ++i) {
+      lockstat_t *stat = &lockstats[cpu][i];
+      if (stat->name == NULL)
+        continue;
+      int row = 0;
+      while (row < nrows && strcmp(rows[row].name, stat->name) != 0)
+        row++;
+      if (row == nrows) {
+        rows[nrows++] = *stat;
+        continue;
+      }
+      rows[row].nr_acquired += stat->nr_acquired;
+      rows[row].nr_contended += stat->nr_contended;
+      rows[row].wait_cycles += stat->wait_cycles;
+      rows[row].hold_cycles += stat->hold_cycles;
+      if (stat->max_wait_cycles > rows[row].max_wait_cycles)
+        rows[row].max_wait_cycles = stat->max_wait_cycles;
+      if (stat->max_hold_cycles > rows[row].max_hold_cycles)
+        rows[row].max_hold_cycles = stat->max_hold_cycles;
+    }
+  }
+
+  for (int i = 1; i < nrows; ++i) {
+    lockstat_t row = rows[i];
+    int j = i;
+    for (; j > 0 && rows[j - 1].wait_cycles < row.wait_cycles; --j)
+      rows[j] = rows[j - 1];
+    rows[j] = row;
+  }
+
+  string_cat(out, "name                   acquired  contended   wait_kc   max_wait"
+                  "   hold_kc   max_hold\n");
+  for (int i = 0; i < nrows; ++i) {
+    lockstat_t *row = &rows[i];
+    sprintf(buf, "%s", row->name);
+    for (size_t len = strlen(buf); len < 20; ++len)
+      strcat(buf, " ");
+    char *line = buf + strlen(buf);
+    sprintf(line, " %10d %10d %9d %10d %9d %10d\n",
+      row->nr_acquired, row->nr_contended,
+      (uint32_t)(row->wait_cycles >> 10), row->max_wait_cycles,
+      (uint32_t)(row->hold_cycles >> 10), row->max_hold_cycles);
+    string_cat(out, buf);
+  }
+}
+#endif
 
 static void push_intr() {
   // It can be the case that we use a lock when
   // interruption is closed, or lock is nested.
-  // Therefore, we use a stack to save the state
-  // of interruption and handle nested lock.
+  // Therefore, we use a per-CPU stack to save the
+  // state of interruption and handle nested lock.
   int intr_state = _intr_read();
   _intr_write(0);
-  if (nintr == 0)
-    intr_save = intr_state;
-  nintr++;
+  struct cpu *cpu = mycpu();
+  if (cpu->nintr == 0)
+    cpu->intr_save = intr_state;
+  cpu->nintr++;
 }
 
 static void pop_intr() {
   Assert(_intr_read() == 0);
-  --nintr;
-  Assert(nintr >= 0);
-  if (nintr == 0 && intr_save == 1)
+  struct cpu *cpu = mycpu();
+  --cpu->nintr;
+  Assert(cpu->nintr >= 0);
+  if (cpu->nintr == 0 && cpu->intr_save == 1)
     _intr_write(1);
 }
 
 static void kmt_spin_lock(spinlock_t *lk) {
   push_intr();
 
-  while (_atomic_xchg(&lk->locked, 1) == 1)
-    continue;
+#ifdef DEBUG_LOCKSTAT
+  uint64_t start = rdtsc();
+#endif
+  int ticket = atomic_xadd(&lk->next, 1);
+#ifdef DEBUG_LOCKSTAT
+  int contended = (ticket != lk->owner);
+#endif
+  int ahead;
+  // tickets wrap around
+  while ((ahead = (int)((unsigned)ticket - (unsigned)lk->owner)) != 0) {
+    for (int i = ahead * SPIN_BACKOFF; i > 0; --i)
+      cpu_relax();
+  }
+#ifdef DEBUG_LOCKSTAT
+  lockstat_acquired(lk, start, contended);
+#endif
 
 #ifdef DEBUG_LOCK
   Log("%s is locked", lk->name);
@@ -303,51 +1216,135 @@ static void kmt_spin_unlock(spinlock_t *lk) {
   Log("%s is unlocked", lk->name);
 #endif
 
-  lk->locked = 0;
+#ifdef DEBUG_LOCKSTAT
+  lockstat_released(lk);
+#endif
+
+  // only the holder writes owner
+  _atomic_xchg(&lk->owner, lk->owner + 1);
 
   pop_intr();
 }
 
 /*------------------------------------------
-                threadqueue
+                    rcu
   ------------------------------------------*/
 
-void threadqueue_init(threadqueue *queue) {
-  queue->head = queue->tail = NULL;
-  queue->size = 0;
+// A CPU in kmt_schedule is outside any read section, so one
+// pass of rcu_qs on every CPU is a grace period. Readers write
+// nothing shared.
+static void kmt_rcu_read_lock() {
+  push_intr();
+}
+
+static void kmt_rcu_read_unlock() {
+  pop_intr();
+}
+
+// Ticks keep every CPU scheduling, idle ones too. Yielding lets
+// our own CPU pass.
+static void kmt_synchronize_rcu() {
+  Assert(_intr_read() == 1);
+  uint32_t snap[MAX_CPU];
+  for (int cpu = 0; cpu < _ncpu(); ++cpu)
+    snap[cpu] = cpus[cpu].rcu_qs;
+  for (int cpu = 0; cpu < _ncpu(); ++cpu)
+    while (cpus[cpu].rcu_qs == snap[cpu])
+      _yield();
 }
 
-int threadqueue_empty(threadqueue *queue) {
-  return queue->size == 0;
+/*------------------------------------------
+                 wait queue
+  ------------------------------------------*/
+
+void waitqueue_init(waitqueue_t *wq) {
+  wq->head = wq->tail = NULL;
 }
 
-void threadqueue_push(threadqueue *queue, thread_t *thread) {
-  threadqueue_node *new_node = (threadqueue_node *)pmm->alloc(
-    sizeof(threadqueue_node));
-  Assert(new_node != NULL);
+int waitqueue_empty(waitqueue_t *wq) {
+  return wq->head == NULL;
+}
 
-  new_node->thread = thread;
-  new_node->next = NULL;
-  if (queue->size == 0)
-    queue->head = new_node;
+static void waitqueue_unlink(waitqueue_t *wq, thread_t *thread) {
+  if (thread->wq_prev != NULL)
+    thread->wq_prev->wq_next = thread->wq_next;
+  else
+    wq->head = thread->wq_next;
+  if (thread->wq_next != NULL)
+    thread->wq_next->wq_prev = thread->wq_prev;
   else
-    queue->tail->next = new_node;
-  queue->tail = new_node;
-  queue->size++;
+    wq->tail = thread->wq_prev;
+  thread->wq_prev = thread->wq_next = NULL;
+  thread->wq = NULL;
 }
 
-thread_t *threadqueue_pop(threadqueue *queue) {
-  Assert(queue->size != 0);
+// Nothing else may be locked, the thread would sleep holding it.
+void waitqueue_sleep(waitqueue_t *wq, spinlock_t *lk) {
+  Assert(mycpu()->nintr == 1);
+  thread_t *cur = mycpu()->current;
+  // a thread being torn down only gives up the CPU
+  if (atomic_cmpxchg(&cur->stat, RUNNING, BLOCKED) == RUNNING) {
+    cur->wq_next = NULL;
+    cur->wq_prev = wq->tail;
+    if (wq->tail != NULL)
+      wq->tail->wq_next = cur;
+    else
+      wq->head = cur;
+    wq->tail = cur;
+    cur->wq = wq;
+    cur->wq_lock = lk;
+  }
+  kmt_spin_unlock(lk);
+  _yield();
+  kmt_spin_lock(lk);
+  cur->wq_lock = NULL;
+}
 
-  thread_t *ret = queue->head->thread;
-  threadqueue_node *save = queue->head;
-  queue->head = queue->head->next;
-  pmm->free(save);
-  queue->size--;
-  if (queue->size == 0)
-    queue->tail = NULL;
+// towake is off its queue already
+static void waitqueue_wake(thread_t *towake) {
+  // boost on wakeup
+  towake->level = towake->prio;
+  towake->timeslice = thread_quantum(towake);
+  towake->wake_tsc = rdtsc();
+  if (atomic_cmpxchg(&towake->stat, BLOCKED, RUNNABLE) == BLOCKED)
+    runqueue_add(towake, towake->last_cpu);
+}
 
-  return ret;
+thread_t *waitqueue_wake_one(waitqueue_t *wq) {
+  thread_t *towake = wq->head;
+  if (towake == NULL)
+    return NULL;
+  waitqueue_unlink(wq, towake);
+  waitqueue_wake(towake);
+  return towake;
+}
+
+// Take the whole list at once instead of unlinking one by one.
+int waitqueue_wake_all(waitqueue_t *wq) {
+  thread_t *towake = wq->head;
+  wq->head = wq->tail = NULL;
+  int n = 0;
+  while (towake != NULL) {
+    thread_t *next = towake->wq_next;
+    towake->wq_prev = towake->wq_next = NULL;
+    towake->wq = NULL;
+    waitqueue_wake(towake);
+    towake = next;
+    n++;
+  }
+  return n;
+}
+
+// The thread is DEAD and not running. Its waker, if any, is done
+// once the queue's lock is taken.
+static void waitqueue_cancel(thread_t *thread) {
+  spinlock_t *lk = thread->wq_lock;
+  if (lk == NULL)
+    return;
+  kmt_spin_lock(lk);
+  if (thread->wq != NULL)
+    waitqueue_unlink(thread->wq, thread);
+  kmt_spin_unlock(lk);
 }
 
 /*------------------------------------------
@@ -356,31 +1353,228 @@ thread_t *threadqueue_pop(threadqueue *queue) {
 
 static void kmt_sem_init(sem_t *sem, const char *name, int value) {
   sem->count = value;
-  threadqueue_init(&sem->queue);
+  waitqueue_init(&sem->queue);
   kmt_spin_init(&sem->lock, name);
 }
 
+// count never goes below zero, so a waiter that is torn down
+// leaves nothing to fix up
 static void kmt_sem_wait(sem_t *sem) {
   kmt_spin_lock(&sem->lock);
+  waitqueue_wait_event(&sem->queue, &sem->lock, sem->count > 0);
   sem->count--;
-  if (sem->count < 0) {
-    Assert(cur_thread != NULL);
-    cur_thread->stat = BLOCKED;
-    threadqueue_push(&sem->queue, cur_thread);
-    kmt_spin_unlock(&sem->lock);
-    _yield();
-    kmt_spin_lock(&sem->lock);
-  }
   kmt_spin_unlock(&sem->lock);
 }
 
 static void kmt_sem_signal(sem_t *sem) {
   kmt_spin_lock(&sem->lock);
   sem->count++;
-  if (sem->count <= 0) {
-    thread_t *towake = threadqueue_pop(&sem->queue);
-    Assert(towake->stat == BLOCKED);
-    towake->stat = RUNNABLE;
-  }
+  waitqueue_wake_one(&sem->queue);
   kmt_spin_unlock(&sem->lock);
-}
\ No newline at end of file
+}
+
+/*------------------------------------------
+                    mutex
+  ------------------------------------------*/
+
+// tries before a waiter stops spinning on a running owner
+#define MUTEX_SPINS 64
+
+static void kmt_mutex_init(mutex_t *mutex, const char *name) {
+  mutex->locked = 0;
+  mutex->nwaiters = 0;
+  mutex->owner = NULL;
+  kmt_spin_init(&mutex->lock, name);
+  waitqueue_init(&mutex->waiters);
+  mutex->name = name;
+}
+
+// Spinning only pays while the owner runs: it will unlock soon.
+static int mutex_spin(mutex_t *mutex) {
+  for (int i = 0; i < MUTEX_SPINS; ++i) {
+    if (_atomic_xchg(&mutex->locked, 1) == 0)
+      return 1;
+    thread_t *owner = mutex->owner;
+    if (owner == NULL || !owner->oncpu)
+      break;
+    for (int j = SPIN_BACKOFF; j > 0; --j)
+      cpu_relax();
+  }
+  return _atomic_xchg(&mutex->locked, 1) == 0;
+}
+
+static void kmt_mutex_lock(mutex_t *mutex) {
+  thread_t *cur = current_thread();
+  Assert(cur == NULL || mutex->owner != cur);
+
+  if (!mutex_spin(mutex)) {
+    // nwaiters goes up before locked is tried again, so an
+    // unlocker that sees it clear also sees us waiting
+    kmt_spin_lock(&mutex->lock);
+    mutex->nwaiters++;
+    while (_atomic_xchg(&mutex->locked, 1) != 0)
+      waitqueue_sleep(&mutex->waiters, &mutex->lock);
+    mutex->nwaiters--;
+    kmt_spin_unlock(&mutex->lock);
+  }
+  mutex->owner = cur;
+
+#ifdef DEBUG_LOCK
+  Log("%s is locked", mutex->name);
+#endif
+}
+
+// A waiter torn down while asleep leaves nwaiters high, which
+// only costs later unlocks a trip through the spin lock.
+static void kmt_mutex_unlock(mutex_t *mutex) {
+
+#ifdef DEBUG_LOCK
+  Log("%s is unlocked", mutex->name);
+#endif
+
+  Assert(mutex->locked);
+  mutex->owner = NULL;
+  _atomic_xchg(&mutex->locked, 0);
+  if (mutex->nwaiters > 0) {
+    kmt_spin_lock(&mutex->lock);
+    waitqueue_wake_one(&mutex->waiters);
+    kmt_spin_unlock(&mutex->lock);
+  }
+}
+
+/*------------------------------------------
+                reader-writer lock
+  ------------------------------------------*/
+
+// Sleeping flavour, the lock just became free and lk->lock is
+// held. The first live writer gets it, readers get in once no
+// writer is left.
+static void rwlock_handoff(rwlock_t *lk) {
+  thread_t *writer;
+  while ((writer = waitqueue_wake_one(&lk->write_waiters)) != NULL) {
+    lk->nwriters_waiting--;
+    if (writer->stat != DEAD) {
+      lk->state = -1;
+      return;
+    }
+  }
+  // writers torn down while queued were never counted off
+  lk->nwriters_waiting = 0;
+  waitqueue_wake_all(&lk->read_waiters);
+}
+
+static void kmt_rwlock_init(rwlock_t *lk, const char *name, int sleepable) {
+  lk->state = 0;
+  lk->writers = 0;
+  lk->nwriters_waiting = 0;
+  lk->sleepable = sleepable;
+  kmt_spin_init(&lk->lock, name);
+  waitqueue_init(&lk->read_waiters);
+  waitqueue_init(&lk->write_waiters);
+  lk->name = name;
+}
+
+// The sleeping flavour decides everything under lk->lock, a
+// writer counts as waiting while it is queued.
+static void kmt_read_lock(rwlock_t *lk) {
+  if (lk->sleepable) {
+    kmt_spin_lock(&lk->lock);
+    while (lk->state < 0 || lk->nwriters_waiting > 0)
+      waitqueue_sleep(&lk->read_waiters, &lk->lock);
+    lk->state++;
+    kmt_spin_unlock(&lk->lock);
+    return;
+  }
+
+  push_intr();
+  while (1) {
+    int state = lk->state;
+    if (state >= 0 && lk->writers == 0 &&
+        atomic_cmpxchg(&lk->state, state, state + 1) == state)
+      break;
+    cpu_relax();
+  }
+}
+
+static void kmt_read_unlock(rwlock_t *lk) {
+  if (lk->sleepable) {
+    kmt_spin_lock(&lk->lock);
+    Assert(lk->state > 0);
+    if (--lk->state == 0)
+      rwlock_handoff(lk);
+    kmt_spin_unlock(&lk->lock);
+    return;
+  }
+
+  Assert(lk->state > 0);
+  atomic_xadd(&lk->state, -1);
+  pop_intr();
+}
+
+static void kmt_write_lock(rwlock_t *lk) {
+  if (lk->sleepable) {
+    kmt_spin_lock(&lk->lock);
+    if (lk->state == 0) {
+      lk->state = -1;
+    } else {
+      // whoever wakes us has made us the owner
+      lk->nwriters_waiting++;
+      waitqueue_sleep(&lk->write_waiters, &lk->lock);
+      Assert(lk->state == -1);
+    }
+    kmt_spin_unlock(&lk->lock);
+    return;
+  }
+
+  push_intr();
+  atomic_xadd(&lk->writers, 1);
+  while (atomic_cmpxchg(&lk->state, 0, -1) != 0)
+    cpu_relax();
+  atomic_xadd(&lk->writers, -1);
+}
+
+static void kmt_write_unlock(rwlock_t *lk) {
+  if (lk->sleepable) {
+    kmt_spin_lock(&lk->lock);
+    Assert(lk->state == -1);
+    lk->state = 0;
+    rwlock_handoff(lk);
+    kmt_spin_unlock(&lk->lock);
+    return;
+  }
+
+  Assert(lk->state == -1);
+  _atomic_xchg(&lk->state, 0);
+  pop_intr();
+}
+
+/*------------------------------------------
+            condition variable
+  ------------------------------------------*/
+
+static void kmt_cond_init(cond_t *cond, const char *name) {
+  waitqueue_init(&cond->waiters);
+  kmt_spin_init(&cond->lock, name);
+}
+
+// cond->lock is taken before the mutex is dropped, so a signal
+// sent after that finds us queued.
+static void kmt_cond_wait(cond_t *cond, mutex_t *mutex) {
+  kmt_spin_lock(&cond->lock);
+  kmt_mutex_unlock(mutex);
+  waitqueue_sleep(&cond->waiters, &cond->lock);
+  kmt_spin_unlock(&cond->lock);
+  kmt_mutex_lock(mutex);
+}
+
+static void kmt_cond_signal(cond_t *cond) {
+  kmt_spin_lock(&cond->lock);
+  waitqueue_wake_one(&cond->waiters);
+  kmt_spin_unlock(&cond->lock);
+}
+
+static void kmt_cond_broadcast(cond_t *cond) {
+  kmt_spin_lock(&cond->lock);
+  waitqueue_wake_all(&cond->waiters);
+  kmt_spin_unlock(&cond->lock);
+}
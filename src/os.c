@@ -19,34 +19,48 @@ static void os_init() {
 
 static void os_run() {
   _intr_write(1); // enable interrupt
-  while (1) ; // should never return
+  while (1)
+    hlt(); // should never return
+}
+
+// The previous thread is released at the next interrupt on this
+// CPU. Until then its stack may still be in use on the way out of
+// the interrupt, so no other CPU is allowed to pick it.
+static void release_prev(struct cpu *cpu) {
+  if (cpu->prev != NULL) {
+    cpu->prev->oncpu = 0;
+    cpu->prev = NULL;
+  }
 }
 
 static _RegSet *switch_thread(_RegSet *regs) {
-  // cur_thread is not initialized
-  if (cur_thread == NULL) {
-    cur_thread = idle;  // schedule IDLE
-    return cur_thread->regs;
+  struct cpu *cpu = mycpu();
+
+  // cur_thread of this CPU is not initialized
+  if (cpu->current == NULL) {
+    cpu->current = cpu->idle;  // schedule IDLE
+    cpu->idle->stat = RUNNING;
+    cpu->idle->oncpu = 1;
+    return cpu->current->regs;
   }
   
-  // consume timeslice and change cur_thread state
-  cur_thread->timeslice--;
-  if (cur_thread->stat == RUNNING)
-    cur_thread->stat = RUNNABLE;
+  // save regs before the thread can be picked again
+  thread_t *prev = cpu->current;
+  prev->regs = regs;
+  prev->timeslice--;
 
-  // decide next thread
+  // decide next thread, which is claimed for this CPU
   thread_t *next = kmt->schedule();
 
-  // save regs, switch and run
-  cur_thread->regs = regs;
-  cur_thread = next;
-  if (cur_thread->timeslice == 0)
-    cur_thread->timeslice = MAX_TIMESLICE;
-  cur_thread->stat = RUNNING;
-  return cur_thread->regs;
+  // switch and run
+  if (next != prev)
+    cpu->prev = prev;
+  cpu->current = next;
+  return next->regs;
 }
 
 static _RegSet *os_interrupt(_Event ev, _RegSet *regs) {
+  release_prev(mycpu());
 
 #ifdef DEBUG
   if (cur_thread)
@@ -60,7 +74,9 @@ static _RegSet *os_interrupt(_Event ev, _RegSet *regs) {
 #endif
       return switch_thread(regs);
     case _EVENT_YIELD: 
+#ifdef DEBUG_SCHEDULE
       Log("Yield! cur_thread thread (tid %d)", cur_thread->tid);
+#endif
       return switch_thread(regs);
     case _EVENT_IRQ_IODEV:
       // _putc('I');
@@ -6,13 +6,294 @@ static void pmm_init();
 static void *pmm_sbrk(int incr);
 static void *pmm_alloc(size_t size);
 static void pmm_free(void *ptr);
+static void *pmm_realloc(void *ptr, size_t size);
+static void *pmm_alloc_pages(int order);
+static void pmm_free_pages(void *ptr);
 
 MOD_DEF(pmm) {
   .init = pmm_init,
   .alloc = pmm_alloc,
   .free = pmm_free,
+  .realloc = pmm_realloc,
+  .alloc_pages = pmm_alloc_pages,
+  .free_pages = pmm_free_pages,
 };
 
+static inline size_t size_aligned(size_t size, size_t align) {
+  return ((size + align - 1) / align) * align;
+}
+
+static inline char *addr_aligned(char *addr, size_t align) {
+  return (char *)(((intptr_t)addr + align - 1) & ~(align - 1));
+}
+
+/*------------------------------------------
+                  reclaim
+  ------------------------------------------*/
+
+// sorted by priority
+static struct {
+  const char *name;
+  int priority;
+  shrinker_t shrink;
+} shrinkers[NR_SHRINKERS];
+static int nr_shrinkers = 0;
+static spinlock_t shrinkers_lock = SPINLOCK_INIT("shrinkers_lock");
+
+void pmm_add_shrinker(const char *name, int priority, shrinker_t shrink) {
+  Assert(shrink != NULL);
+  kmt->spin_lock(&shrinkers_lock);
+  if (nr_shrinkers == NR_SHRINKERS)
+    Panic("Too many shrinkers");
+  int i = nr_shrinkers++;
+  for (; i > 0 && shrinkers[i - 1].priority > priority; --i)
+    shrinkers[i] = shrinkers[i - 1];
+  shrinkers[i].name = name;
+  shrinkers[i].priority = priority;
+  shrinkers[i].shrink = shrink;
+  kmt->spin_unlock(&shrinkers_lock);
+}
+
+// Run shrinkers from *next on until one of them releases memory.
+// Returns 0 when there is nothing left to reclaim. Callers must
+// not hold any allocator lock, since shrinkers free memory.
+static int reclaim(int *next) {
+  while (1) {
+    kmt->spin_lock(&shrinkers_lock);
+    if (*next >= nr_shrinkers) {
+      kmt->spin_unlock(&shrinkers_lock);
+      return 0;
+    }
+    const char *name = shrinkers[*next].name;
+    shrinker_t shrink = shrinkers[*next].shrink;
+    (*next)++;
+    kmt->spin_unlock(&shrinkers_lock);
+
+    size_t freed = shrink();
+    if (freed > 0) {
+      Log("Reclaimed %d bytes from %s", freed, name);
+      return 1;
+    }
+  }
+}
+
+/*------------------------------------------
+                    buddy
+  ------------------------------------------*/
+
+#define MAX_ORDER         10  // largest block is 4MB
+#define BUDDY_GROW_ORDER  4   // grow at least 64KB from sbrk
+
+enum { PAGE_NONE, PAGE_FREE, PAGE_ALLOC, PAGE_FREELIST };
+
+// One page_t for every page in _heap. Only the first
+// page of a block (free or allocated) has flags and order.
+typedef struct page {
+  struct page *prev;
+  struct page *next;
+  int order;
+  int flags;
+} page_t;
+
+static char *page_base;     // address of pages[0]
+static char *page_end;
+static page_t *pages;
+static page_t *free_area[MAX_ORDER + 1];
+static size_t nr_free_pages = 0;
+static int nr_free_page_blocks = 0;
+static spinlock_t buddy_lock = SPINLOCK_INIT("buddy_lock");
+
+static inline page_t *addr_to_page(void *addr) {
+  return &pages[((char *)addr - page_base) / PGSIZE];
+}
+
+static inline char *page_to_addr(page_t *pg) {
+  return page_base + (pg - pages) * PGSIZE;
+}
+
+static inline size_t order_size(int order) {
+  return (size_t)PGSIZE << order;
+}
+
+// MAX_ORDER + 1 for sizes too large for any block, order_size
+// would wrap around before reaching them.
+static inline int size_order(size_t size) {
+  int order = 0;
+  while (order <= MAX_ORDER && order_size(order) < size)
+    order++;
+  return order;
+}
+
+static void free_area_add(int order, page_t *pg) {
+  pg->flags = PAGE_FREE;
+  pg->order = order;
+  pg->prev = NULL;
+  pg->next = free_area[order];
+  if (free_area[order] != NULL)
+    free_area[order]->prev = pg;
+  free_area[order] = pg;
+  nr_free_pages += 1 << order;
+  nr_free_page_blocks++;
+}
+
+static void free_area_remove(int order, page_t *pg) {
+  if (pg->prev != NULL)
+    pg->prev->next = pg->next;
+  else
+    free_area[order] = pg->next;
+  if (pg->next != NULL)
+    pg->next->prev = pg->prev;
+  pg->prev = pg->next = NULL;
+  pg->flags = PAGE_NONE;
+  nr_free_pages -= 1 << order;
+  nr_free_page_blocks--;
+}
+
+// Blocks are naturally aligned, so the buddy of a block
+// is found by flipping the bit of its order in the address.
+static void buddy_free_block(char *addr, int order) {
+  while (order < MAX_ORDER) {
+    char *buddy = (char *)((intptr_t)addr ^ order_size(order));
+    if (buddy < page_base || buddy >= pmm_brk)
+      break;
+    page_t *bpg = addr_to_page(buddy);
+    if (bpg->flags != PAGE_FREE || bpg->order != order)
+      break;
+    free_area_remove(order, bpg);
+    if (buddy < addr)
+      addr = buddy;
+    order++;
+  }
+  free_area_add(order, addr_to_page(addr));
+}
+
+// Release [start, end) to buddy as largest aligned blocks.
+static void buddy_free_range(char *start, char *end) {
+  while (start < end) {
+    int order = MAX_ORDER;
+    while (order > 0 && (((intptr_t)start & (order_size(order) - 1)) ||
+                         start + order_size(order) > end))
+      order--;
+    buddy_free_block(start, order);
+    start += order_size(order);
+  }
+}
+
+// Take an aligned block of at least the given order from sbrk.
+// The gap before the aligned address goes to buddy as well.
+// Near the end of heap, whatever is left is taken instead.
+static int buddy_grow(int order) {
+  if (order < BUDDY_GROW_ORDER)
+    order = BUDDY_GROW_ORDER;
+  char *start = pmm_brk;
+  char *end = addr_aligned(start, order_size(order)) + order_size(order);
+  if (end > page_end)
+    end = page_end;
+  if (start == end)
+    return -1;
+  if (pmm_sbrk(end - start) == (void *)-1)
+    return -1;
+  buddy_free_range(start, end);
+  return 0;
+}
+
+static void *buddy_alloc(int order) {
+  if (order < 0 || order > MAX_ORDER)
+    return NULL;
+
+  kmt->spin_lock(&buddy_lock);
+  int k;
+  while (1) {
+    for (k = order; k <= MAX_ORDER && free_area[k] == NULL; ++k)
+      continue;
+    if (k <= MAX_ORDER)
+      break;
+    if (buddy_grow(order) != 0) {
+      kmt->spin_unlock(&buddy_lock);
+      return NULL;
+    }
+  }
+
+  // split the block until it fits
+  page_t *pg = free_area[k];
+  free_area_remove(k, pg);
+  while (k > order) {
+    k--;
+    free_area_add(k, pg + (1 << k));
+  }
+  pg->flags = PAGE_ALLOC;
+  pg->order = order;
+  kmt->spin_unlock(&buddy_lock);
+
+  return (void *)page_to_addr(pg);
+}
+
+static void buddy_free(void *ptr) {
+  Assert(((intptr_t)ptr & (PGSIZE - 1)) == 0);
+  kmt->spin_lock(&buddy_lock);
+  page_t *pg = addr_to_page(ptr);
+  Assert(pg->flags == PAGE_ALLOC);
+  pg->flags = PAGE_NONE;
+  buddy_free_block((char *)ptr, pg->order);
+  kmt->spin_unlock(&buddy_lock);
+}
+
+// Grow an allocated block in place by absorbing its right
+// buddies while they are free. Returns 0 on success.
+static int buddy_grow_inplace(void *ptr, int order) {
+  Assert(order <= MAX_ORDER);
+  kmt->spin_lock(&buddy_lock);
+  page_t *pg = addr_to_page(ptr);
+  Assert(pg->flags == PAGE_ALLOC);
+
+  // check before changing anything
+  int k;
+  for (k = pg->order; k < order; ++k) {
+    char *buddy = (char *)((intptr_t)ptr ^ order_size(k));
+    if (buddy < (char *)ptr || buddy >= pmm_brk)
+      break;
+    page_t *bpg = addr_to_page(buddy);
+    if (bpg->flags != PAGE_FREE || bpg->order != k)
+      break;
+  }
+  if (k < order) {
+    kmt->spin_unlock(&buddy_lock);
+    return -1;
+  }
+
+  for (k = pg->order; k < order; ++k)
+    free_area_remove(k, addr_to_page((char *)ptr + order_size(k)));
+  pg->order = order;
+  kmt->spin_unlock(&buddy_lock);
+  return 0;
+}
+
+static void buddy_init() {
+  page_base = addr_aligned((char *)_heap.start, PGSIZE);
+  page_end = (char *)((intptr_t)_heap.end & ~(PGSIZE - 1));
+  pmm_brk = page_base;
+
+  // page array is placed at the beginning of heap
+  size_t npages = (page_end - page_base) / PGSIZE;
+  pages = (page_t *)pmm_sbrk(size_aligned(npages * sizeof(page_t), PGSIZE));
+  Assert(pages != (void *)-1);
+  memset(pages, 0, npages * sizeof(page_t));
+  for (int i = 0; i <= MAX_ORDER; ++i)
+    free_area[i] = NULL;
+}
+
+// Blocks from buddy are naturally aligned, so large
+// requests go to buddy without being doubled.
+static inline int is_page_alloc(size_t size) {
+  return size > PGSIZE / 2;
+}
+
+static inline int is_page_ptr(void *ptr) {
+  return ((intptr_t)ptr & (PGSIZE - 1)) == 0 &&
+         (char *)ptr >= page_base && (char *)ptr < pmm_brk &&
+         addr_to_page(ptr)->flags == PAGE_ALLOC;
+}
+
 /*------------------------------------------
                   freelist
   ------------------------------------------*/
@@ -21,108 +302,263 @@ MOD_DEF(pmm) {
 
 typedef long Align;
 
+// Size of a block includes its header. Sizes are multiples of
+// sizeof(Header), so the low bits of size are used as flags.
+//
+// Boundary tags: a free block repeats its size in the last word
+// (footer), and every header records whether the block before
+// it is allocated. Both neighbours of a block can then be found
+// and merged in constant time.
 typedef union header {
   struct {
-    union header *next;
+    union header *next;   // next free block in the same bin
     size_t size;
   };
   Align x;
 } Header;
 
-static Header base;
-static Header *freelistp; // implemented as circular linked list
+#define BLOCK_ALLOC       1
+#define BLOCK_PREV_ALLOC  2
+#define BLOCK_FLAGS       (BLOCK_ALLOC | BLOCK_PREV_ALLOC)
+#define MIN_BLOCKSIZE     (2 * sizeof(Header))
+
+// Segregated bins: exact classes for small blocks, then one
+// class per power of two. binmap marks bins that are non-empty.
+#define NR_SMALL_BINS   64
+#define SMALL_BIN_LIMIT (NR_SMALL_BINS * sizeof(Header))
+#define NR_BINS         96
+#define BINMAP_BITS     32
+
+static Header *bins[NR_BINS];
+static uint32_t binmap[NR_BINS / BINMAP_BITS];
+static size_t freelist_free_bytes = 0;
+static int freelist_nr_free = 0;
+static size_t freelist_chunk_bytes = 0;
 
-static void freelist_init();
 static Header *freelist_extend(size_t size);
 static void *freelist_alloc(size_t size);
 static void freelist_free(void *ap);
 
-static inline size_t size_aligned(size_t size, size_t align) {
-  return ((size + align - 1) / align) * align;
+static inline size_t block_size(Header *bp) {
+  return bp->size & ~BLOCK_FLAGS;
 }
 
-static inline char *addr_aligned(char *addr, size_t align) {
-  return (char *)(((intptr_t)addr + align - 1) & ~(align - 1));
+static inline int block_alloced(Header *bp) {
+  return bp->size & BLOCK_ALLOC;
+}
+
+static inline int block_prev_alloced(Header *bp) {
+  return bp->size & BLOCK_PREV_ALLOC;
+}
+
+static inline Header *block_next(Header *bp) {
+  return (Header *)((char *)bp + block_size(bp));
+}
+
+static inline size_t *block_footer(Header *bp) {
+  return (size_t *)((char *)bp + block_size(bp)) - 1;
+}
+
+// only valid if the previous block is free
+static inline Header *block_prev(Header *bp) {
+  return (Header *)((char *)bp - *((size_t *)bp - 1));
+}
+
+// A free block keeps the previous block of its bin
+// in the first word of payload.
+static inline Header **block_prevp(Header *bp) {
+  return (Header **)(bp + 1);
 }
 
-static void freelist_init() {
-  base.next = freelistp = &base;
-  base.size = 0;
+static inline int log2_floor(size_t x) {
+  return 31 - __builtin_clz(x);
 }
 
+static int bin_index(size_t size) {
+  if (size < SMALL_BIN_LIMIT)
+    return size / sizeof(Header);
+  int index = NR_SMALL_BINS + log2_floor(size) - log2_floor(SMALL_BIN_LIMIT);
+  return index < NR_BINS ? index : NR_BINS - 1;
+}
+
+static inline int bin_is_small(int index) {
+  return index < NR_SMALL_BINS;
+}
+
+// find the first non-empty bin no less than index
+static int binmap_find(int index) {
+  for (int i = index / BINMAP_BITS; i < NR_BINS / BINMAP_BITS; ++i) {
+    uint32_t word = binmap[i];
+    if (i == index / BINMAP_BITS)
+      word &= ~0u << (index % BINMAP_BITS);
+    if (word != 0)
+      return i * BINMAP_BITS + __builtin_ctz(word);
+  }
+  return -1;
+}
+
+static void bin_insert(Header *bp) {
+  int index = bin_index(block_size(bp));
+  bp->next = bins[index];
+  *block_prevp(bp) = NULL;
+  if (bins[index] != NULL)
+    *block_prevp(bins[index]) = bp;
+  bins[index] = bp;
+  binmap[index / BINMAP_BITS] |= 1u << (index % BINMAP_BITS);
+  freelist_free_bytes += block_size(bp);
+  freelist_nr_free++;
+}
+
+static void bin_remove(Header *bp) {
+  int index = bin_index(block_size(bp));
+  Header *prev = *block_prevp(bp);
+  if (prev != NULL)
+    prev->next = bp->next;
+  else
+    bins[index] = bp->next;
+  if (bp->next != NULL)
+    *block_prevp(bp->next) = prev;
+  if (bins[index] == NULL)
+    binmap[index / BINMAP_BITS] &= ~(1u << (index % BINMAP_BITS));
+  freelist_free_bytes -= block_size(bp);
+  freelist_nr_free--;
+}
+
+// The largest free block is in the highest non-empty bin.
+static size_t freelist_largest() {
+  size_t largest = 0;
+  for (int index = NR_BINS - 1; index >= 0; --index) {
+    if (bins[index] == NULL)
+      continue;
+    for (Header *bp = bins[index]; bp != NULL; bp = bp->next)
+      if (block_size(bp) > largest)
+        largest = block_size(bp);
+    break;
+  }
+  return largest;
+}
+
+// Cut an allocated block to size and free the rest if it is
+// big enough to be a block.
+static void block_trim(Header *bp, size_t size) {
+  size_t rest = block_size(bp) - size;
+  if (rest < MIN_BLOCKSIZE)
+    return;
+  bp->size = size | (bp->size & BLOCK_FLAGS);
+  Header *rp = block_next(bp);
+  rp->size = rest | BLOCK_ALLOC | BLOCK_PREV_ALLOC;
+  freelist_free((void *)(rp + 1));
+}
+
+// Chunks of free list come from buddy and are only returned by
+// freelist_shrink. Each chunk ends with an allocated header of
+// size 0, so that merging never walks out of the chunk.
 static Header *freelist_extend(size_t size) {
   void *p;
-  Header *hp;
+  Header *hp, *fence;
+  int order;
 
-  if ((size = size_aligned(size, sizeof(Header))) < CHUCKSIZE)
+  size = size_aligned(size, sizeof(Header)) + sizeof(Header);
+  if (size < CHUCKSIZE)
     size = CHUCKSIZE;
 
-  if ((p = pmm_sbrk(size)) == (void *)-1)
+  order = size_order(size);
+  if ((p = buddy_alloc(order)) == NULL)
     return NULL;
+  addr_to_page(p)->flags = PAGE_FREELIST;
+  freelist_chunk_bytes += order_size(order);
 
   hp = (Header *)p;
-  hp->size = size;
+  hp->size = (order_size(order) - sizeof(Header)) | BLOCK_FLAGS;
+  fence = block_next(hp);
+  fence->size = 0 | BLOCK_FLAGS;
   freelist_free((void *)(hp + 1));
 
-  return freelistp;
+  return hp;
 }
 
 static void freelist_free(void *ap) {
-  Header *bp, *pos;
+  Header *bp, *next, *prev;
 
   bp = (Header *)ap - 1;  // block to free
+  Assert(block_alloced(bp));
+  bp->size &= ~BLOCK_ALLOC;
 
-  // search the position to insert block in free list
-  for (pos = freelistp; !(bp > pos && bp < pos->next); pos = pos->next)
-    if (pos >= pos->next && (bp > pos || bp < pos->next))
-      break;  // block is at the end or the beginning of free list
+  // try to merge with the next block
+  next = block_next(bp);
+  if (!block_alloced(next)) {
+    bin_remove(next);
+    bp->size += block_size(next);
+  }
 
   // try to merge with the previous block
-  if ((char *)bp + bp->size == (char *)pos->next) {
-    bp->size += pos->next->size;
-    bp->next = pos->next->next;
-  } else
-    bp->next = pos->next;
+  if (!block_prev_alloced(bp)) {
+    prev = block_prev(bp);
+    bin_remove(prev);
+    prev->size += block_size(bp);
+    bp = prev;
+  }
+
+  *block_footer(bp) = block_size(bp);
+  block_next(bp)->size &= ~BLOCK_PREV_ALLOC;
 
-  // try to merge with the next block
-  if ((char *)pos + pos->size == (char *)bp) {
-    pos->size += bp->size;
-    pos->next = bp->next;
-  } else
-    pos->next = bp;
-    
   // LIFO schema
-  freelistp = pos;
+  bin_insert(bp);
 }
 
 static void *freelist_alloc(size_t size) {
-  Header *cur, *prev;
-
-  if (freelistp == NULL) 
-    freelist_init();
+  Header *bp = NULL;
 
   // adjust to align
   size = size_aligned(size, sizeof(Header)) + sizeof(Header);
+  if (size < MIN_BLOCKSIZE)
+    size = MIN_BLOCKSIZE;
 
-  prev = freelistp;
-  for (cur = prev->next; ; prev = cur, cur = cur->next) {
-    // find a block that fits size
-    if (cur->size >= size) {
-      if (cur->size == size)
-        prev->next = cur->next;
-      else {
-        cur->size -= size;
-        cur = (Header *)((char *)cur + cur->size);
-        cur->size = size;
-      }
-      freelistp = prev;
-      return (void *)(cur + 1);
+  int index = bin_index(size);
+  while (bp == NULL) {
+    // blocks in a large bin may be smaller than size
+    if (!bin_is_small(index))
+      for (bp = bins[index]; bp != NULL; bp = bp->next)
+        if (block_size(bp) >= size)
+          break;
+
+    // blocks in any bigger bin always fit
+    if (bp == NULL) {
+      int found = binmap_find(bin_is_small(index) ? index : index + 1);
+      if (found >= 0)
+        bp = bins[found];
     }
+
     // if can't find, acquire a new area of heap
-    if (cur == freelistp)
-      if((cur = freelist_extend(size)) == NULL)
-        return NULL;
+    if (bp == NULL && freelist_extend(size) == NULL)
+      return NULL;
   }
+
+  bin_remove(bp);
+  bp->size |= BLOCK_ALLOC;
+  block_next(bp)->size |= BLOCK_PREV_ALLOC;
+  block_trim(bp, size);
+  return (void *)(bp + 1);
+}
+
+// Grow an allocated block in place if the next block is free
+// and big enough. Returns 0 on success.
+static int freelist_grow_inplace(void *ap, size_t size) {
+  Header *bp = (Header *)ap - 1;
+  Assert(block_alloced(bp));
+
+  size = size_aligned(size, sizeof(Header)) + sizeof(Header);
+  if (block_size(bp) >= size)
+    return 0;
+
+  Header *next = block_next(bp);
+  if (block_alloced(next) || block_size(bp) + block_size(next) < size)
+    return -1;
+  bin_remove(next);
+  bp->size += block_size(next);
+  block_next(bp)->size |= BLOCK_PREV_ALLOC;
+  block_trim(bp, size);
+  return 0;
 }
 
 static void *addr_aligned_alloc(size_t size) {
@@ -130,75 +566,927 @@ static void *addr_aligned_alloc(size_t size) {
   size_t new_size = 1;
   while (new_size < size)
     new_size <<= 1;
+  if (new_size <= sizeof(Header))
+    return freelist_alloc(size);
   
-  // alloc twice bigger size to ensure
-  // enough memory starting from the address to align
-  char *addr = (char *)freelist_alloc(new_size * 2);
+  // alloc enough memory to leave a free block
+  // in front of the aligned address
+  char *addr = (char *)freelist_alloc(new_size * 2 + MIN_BLOCKSIZE);
   if (addr == NULL)
     return NULL;
     
-  char *new_addr = addr_aligned(addr, new_size);
-  if (new_addr == addr)
-    return (void *)addr;
-  
-  int gap = new_addr - addr;
-  Assert(gap >= sizeof(Header));
   Header *bp = (Header *)addr - 1;
-  Header *new_bp = (Header *)new_addr - 1;
-  new_bp->size = bp->size - gap;
-  bp->size = gap;
-  freelist_free(addr);
+  char *new_addr = addr;
+  if (addr_aligned(addr, new_size) != addr) {
+    new_addr = addr_aligned(addr + MIN_BLOCKSIZE, new_size);
+    int gap = new_addr - addr;
+    Header *new_bp = (Header *)new_addr - 1;
+    new_bp->size = (block_size(bp) - gap) | BLOCK_ALLOC | BLOCK_PREV_ALLOC;
+    bp->size = gap | (bp->size & BLOCK_FLAGS);
+    freelist_free(addr);
+    bp = new_bp;
+  }
 
+  // give back the tail
+  block_trim(bp, size_aligned(size, sizeof(Header)) + sizeof(Header));
   return new_addr;
 }
 
+static spinlock_t pmm_lock = SPINLOCK_INIT("freelist_lock");
+
+// Give chunks that are entirely free back to buddy.
+static size_t freelist_shrink() {
+  size_t freed = 0;
+  kmt->spin_lock(&pmm_lock);
+  for (int index = bin_index(CHUCKSIZE - sizeof(Header)); index < NR_BINS; ++index) {
+    Header *bp = bins[index];
+    while (bp != NULL) {
+      Header *next = bp->next;
+      page_t *pg = addr_to_page(bp);
+      if (((intptr_t)bp & (PGSIZE - 1)) == 0 && pg->flags == PAGE_FREELIST &&
+          block_size(bp) == order_size(pg->order) - sizeof(Header)) {
+        bin_remove(bp);
+        freelist_chunk_bytes -= order_size(pg->order);
+        freed += order_size(pg->order);
+        pg->flags = PAGE_ALLOC;
+        buddy_free(bp);
+      }
+      bp = next;
+    }
+  }
+  kmt->spin_unlock(&pmm_lock);
+  return freed;
+}
+
 /*------------------------------------------
-                    pmm
+                    slab
   ------------------------------------------*/
 
-static spinlock_t pmm_lock = SPINLOCK_INIT("freelist_lock");
+#define SLAB_ALIGN  8
+
+// Slab header lives at the start of its page, so the slab
+// of an object can be found by masking the object address.
+typedef struct slab {
+  slab_cache_t *cache;
+  struct slab *prev;
+  struct slab *next;
+  void *freelist;   // free objects, linked through their first word
+  int inuse;
+} slab_t;
+
+static slab_cache_t *slab_caches = NULL;
+static spinlock_t slab_caches_lock = SPINLOCK_INIT("slab_caches_lock");
+
+static inline slab_t *slab_of(void *obj) {
+  return (slab_t *)((intptr_t)obj & ~(PGSIZE - 1));
+}
+
+static inline size_t slab_obj_offset() {
+  return size_aligned(sizeof(slab_t), SLAB_ALIGN);
+}
+
+static void slab_list_add(slab_t **list, slab_t *slab) {
+  slab->prev = NULL;
+  slab->next = *list;
+  if (*list != NULL)
+    (*list)->prev = slab;
+  *list = slab;
+}
+
+static void slab_list_remove(slab_t **list, slab_t *slab) {
+  if (slab->prev != NULL)
+    slab->prev->next = slab->next;
+  else
+    *list = slab->next;
+  if (slab->next != NULL)
+    slab->next->prev = slab->prev;
+  slab->prev = slab->next = NULL;
+}
+
+static slab_t *slab_new(slab_cache_t *cache) {
+  slab_t *slab = (slab_t *)buddy_alloc(0);
+  if (slab == NULL)
+    return NULL;
+
+  slab->cache = cache;
+  slab->prev = slab->next = NULL;
+  slab->inuse = 0;
+  slab->freelist = NULL;
+
+  // thread objects to free list from the end
+  // so that they are handed out in address order
+  char *objs = (char *)slab + slab_obj_offset();
+  for (int i = cache->objs_per_slab - 1; i >= 0; --i) {
+    void **obj = (void **)(objs + i * cache->objsize);
+    *obj = slab->freelist;
+    slab->freelist = obj;
+  }
+  cache->nslabs++;
+  return slab;
+}
+
+static void slab_delete(slab_cache_t *cache, slab_t *slab) {
+  Assert(slab->inuse == 0);
+  cache->nslabs--;
+  buddy_free(slab);
+}
+
+// Caches are registered on first use.
+// slab_caches_lock is always taken before cache->lock.
+static void slab_cache_setup(slab_cache_t *cache) {
+  kmt->spin_lock(&slab_caches_lock);
+  if (!cache->registered) {
+    kmt->spin_lock(&cache->lock);
+    if (cache->objsize < sizeof(void *))
+      cache->objsize = sizeof(void *);
+    cache->objsize = size_aligned(cache->objsize, SLAB_ALIGN);
+    cache->objs_per_slab = (PGSIZE - slab_obj_offset()) / cache->objsize;
+    Assert(cache->objs_per_slab > 0);
+    kmt->spin_unlock(&cache->lock);
+
+    cache->next = slab_caches;
+    slab_caches = cache;
+    cache->registered = 1;
+  }
+  kmt->spin_unlock(&slab_caches_lock);
+}
+
+void slab_cache_init(slab_cache_t *cache, const char *name, size_t objsize) {
+  Assert(cache != NULL);
+  *cache = SLAB_CACHE_INIT(name, objsize);
+}
+
+// All objects must have been freed.
+void slab_cache_destroy(slab_cache_t *cache) {
+  Assert(cache != NULL);
+  kmt->spin_lock(&slab_caches_lock);
+  if (cache->registered) {
+    slab_cache_t **pp = &slab_caches;
+    while (*pp != cache)
+      pp = &(*pp)->next;
+    *pp = cache->next;
+    cache->registered = 0;
+  }
+  kmt->spin_lock(&cache->lock);
+  Assert(cache->nobjs == 0);
+  Assert(cache->partial == NULL && cache->full == NULL);
+  while (cache->empty != NULL) {
+    slab_t *slab = cache->empty;
+    slab_list_remove(&cache->empty, slab);
+    slab_delete(cache, slab);
+  }
+  kmt->spin_unlock(&cache->lock);
+  kmt->spin_unlock(&slab_caches_lock);
+}
+
+static void *slab_cache_try_alloc(slab_cache_t *cache) {
+  kmt->spin_lock(&cache->lock);
+  slab_t *slab = cache->partial;
+  if (slab == NULL) {
+    if ((slab = cache->empty) != NULL)
+      slab_list_remove(&cache->empty, slab);
+    else if ((slab = slab_new(cache)) == NULL) {
+      kmt->spin_unlock(&cache->lock);
+      return NULL;
+    }
+    slab_list_add(&cache->partial, slab);
+  }
+
+  void **obj = slab->freelist;
+  slab->freelist = *obj;
+  slab->inuse++;
+  cache->nobjs++;
+  if (slab->inuse == cache->objs_per_slab) {
+    slab_list_remove(&cache->partial, slab);
+    slab_list_add(&cache->full, slab);
+  }
+
+  kmt->spin_unlock(&cache->lock);
+  return (void *)obj;
+}
+
+void *slab_cache_alloc(slab_cache_t *cache) {
+  Assert(cache != NULL);
+  if (!cache->registered)
+    slab_cache_setup(cache);
+
+  void *obj;
+  int next = 0;
+  do {
+    obj = slab_cache_try_alloc(cache);
+  } while (obj == NULL && reclaim(&next));
+  return obj;
+}
+
+void slab_cache_free(slab_cache_t *cache, void *obj) {
+  Assert(cache != NULL && obj != NULL);
+  slab_t *slab = slab_of(obj);
+  Assert(slab->cache == cache);
+
+  kmt->spin_lock(&cache->lock);
+  if (slab->inuse == cache->objs_per_slab) {
+    slab_list_remove(&cache->full, slab);
+    slab_list_add(&cache->partial, slab);
+  }
+  *(void **)obj = slab->freelist;
+  slab->freelist = obj;
+  slab->inuse--;
+  cache->nobjs--;
+
+  // keep one empty slab to avoid thrashing, release the others
+  if (slab->inuse == 0) {
+    slab_list_remove(&cache->partial, slab);
+    if (cache->empty == NULL)
+      slab_list_add(&cache->empty, slab);
+    else
+      slab_delete(cache, slab);
+  }
+  kmt->spin_unlock(&cache->lock);
+}
+
+// Release the empty slab kept by the cache.
+size_t slab_cache_shrink(slab_cache_t *cache) {
+  Assert(cache != NULL);
+  size_t freed = 0;
+  kmt->spin_lock(&cache->lock);
+  while (cache->empty != NULL) {
+    slab_t *slab = cache->empty;
+    slab_list_remove(&cache->empty, slab);
+    slab_delete(cache, slab);
+    freed += PGSIZE;
+  }
+  kmt->spin_unlock(&cache->lock);
+  return freed;
+}
+
+static size_t slab_shrink() {
+  size_t freed = 0;
+  kmt->spin_lock(&slab_caches_lock);
+  for (slab_cache_t *cache = slab_caches; cache != NULL; cache = cache->next)
+    freed += slab_cache_shrink(cache);
+  kmt->spin_unlock(&slab_caches_lock);
+  return freed;
+}
+
+#define SLAB_INFO_LINE 128
+
+// Lines are formatted into a buffer allocated beforehand, as
+// allocating with slab_caches_lock held may run slab_shrink.
+void slab_info_render(string_t *out) {
+  int ncaches = 0;
+  kmt->spin_lock(&slab_caches_lock);
+  for (slab_cache_t *cache = slab_caches; cache != NULL; cache = cache->next)
+    ncaches++;
+  kmt->spin_unlock(&slab_caches_lock);
+
+  char *buf = arena_alloc(thread_arena(), ncaches * SLAB_INFO_LINE + 1);
+  if (buf == NULL)
+    return;
+  char *line = buf;
+  *line = '\0';
+  kmt->spin_lock(&slab_caches_lock);
+  for (slab_cache_t *cache = slab_caches; cache != NULL && ncaches > 0;
+       cache = cache->next, ncaches--) {
+    sprintf(line, "%s", cache->name);
+    for (size_t len = strlen(line); len < 20; ++len)
+      strcat(line, " ");
+    line += strlen(line);
+    line += sprintf(line, " %7d %6d %6d %6d\n", cache->objsize,
+      cache->nobjs, cache->nslabs * cache->objs_per_slab, cache->nslabs);
+  }
+  kmt->spin_unlock(&slab_caches_lock);
+
+  string_cat(out, "name                 objsize  inuse  total  slabs\n");
+  string_cat(out, buf);
+}
+
+/*------------------------------------------
+                  magazine
+  ------------------------------------------*/
+
+// Every CPU caches recently freed blocks of each power-of-two
+// class in a magazine. The magazine is only touched by its own
+// CPU with interrupts disabled, so the common path takes no
+// shared lock. Misses refill and full magazines flush half a
+// magazine at a time under pmm_lock.
+#define MAG_SIZE        16
+#define MAG_BATCH       (MAG_SIZE / 2)
+#define MAG_MIN_SHIFT   3   // smallest class is 8 bytes
+#define NR_MAG_CLASSES  9   // largest class is PGSIZE / 2
+
+typedef struct magazine {
+  int nr;
+  void *objs[MAG_SIZE];
+} magazine_t;
+
+// magazine classes, then one class for each page order
+#define NR_SIZE_CLASSES (NR_MAG_CLASSES + MAX_ORDER + 1)
+
+typedef struct cpu_cache {
+  magazine_t mags[NR_MAG_CLASSES];
+  int alloc_hits;
+  int alloc_misses;
+  int free_hits;
+  int free_misses;
+  int nr_alloc[NR_SIZE_CLASSES];
+  int nr_free[NR_SIZE_CLASSES];
+} cpu_cache_t;
+
+static cpu_cache_t cpu_caches[MAX_CPU];
+
+static inline size_t mag_class_size(int class) {
+  return (size_t)1 << (class + MAG_MIN_SHIFT);
+}
+
+static inline int mag_class(size_t size) {
+  int class = 0;
+  while (mag_class_size(class) < size)
+    class++;
+  return class;
+}
+
+// A block can serve a class if it is both big and aligned
+// enough. Returns -1 if the block can't be cached, or if it is
+// more than twice the class size and would be wasted there.
+static int mag_class_of(void *ptr) {
+  size_t payload = block_size((Header *)ptr - 1) - sizeof(Header);
+  int shift = log2_floor(payload);
+  int align = __builtin_ctz((intptr_t)ptr);
+  if (align < shift)
+    shift = align;
+  int class = shift - MAG_MIN_SHIFT;
+  if (class < 0 || class >= NR_MAG_CLASSES ||
+      payload > 2 * mag_class_size(class))
+    return -1;
+  return class;
+}
+
+static void *magazine_alloc(size_t size) {
+  int class = mag_class(size);
+  void *ret = NULL;
+
+  int intr = _intr_read();
+  _intr_write(0);
+  cpu_cache_t *cache = &cpu_caches[_cpu()];
+  magazine_t *mag = &cache->mags[class];
+  if (mag->nr > 0) {
+    cache->alloc_hits++;
+  } else {
+    cache->alloc_misses++;
+    kmt->spin_lock(&pmm_lock);
+    while (mag->nr < MAG_BATCH) {
+      void *obj = addr_aligned_alloc(mag_class_size(class));
+      if (obj == NULL)
+        break;
+      mag->objs[mag->nr++] = obj;
+    }
+    kmt->spin_unlock(&pmm_lock);
+  }
+  if (mag->nr > 0)
+    ret = mag->objs[--mag->nr];
+  _intr_write(intr);
+
+  return ret;
+}
+
+static void magazine_free(void *ptr) {
+  int class = mag_class_of(ptr);
+  if (class < 0) {
+    kmt->spin_lock(&pmm_lock);
+    freelist_free(ptr);
+    kmt->spin_unlock(&pmm_lock);
+    return;
+  }
+
+  int intr = _intr_read();
+  _intr_write(0);
+  cpu_cache_t *cache = &cpu_caches[_cpu()];
+  magazine_t *mag = &cache->mags[class];
+  if (mag->nr < MAG_SIZE) {
+    cache->free_hits++;
+  } else {
+    cache->free_misses++;
+    kmt->spin_lock(&pmm_lock);
+    while (mag->nr > MAG_SIZE - MAG_BATCH)
+      freelist_free(mag->objs[--mag->nr]);
+    kmt->spin_unlock(&pmm_lock);
+  }
+  mag->objs[mag->nr++] = ptr;
+  _intr_write(intr);
+}
+
+// Only the magazines of this CPU can be flushed, the others
+// are touched by their own CPU without a shared lock.
+static size_t magazine_shrink() {
+  size_t freed = 0;
+  int intr = _intr_read();
+  _intr_write(0);
+  cpu_cache_t *cache = &cpu_caches[_cpu()];
+  kmt->spin_lock(&pmm_lock);
+  for (int class = 0; class < NR_MAG_CLASSES; ++class) {
+    magazine_t *mag = &cache->mags[class];
+    while (mag->nr > 0) {
+      void *obj = mag->objs[--mag->nr];
+      freed += block_size((Header *)obj - 1);
+      freelist_free(obj);
+    }
+  }
+  kmt->spin_unlock(&pmm_lock);
+  _intr_write(intr);
+  return freed;
+}
+
+// in percent, avoid overflow of hits * 100
+static inline int hit_rate(int hits, int misses) {
+  int total = hits + misses;
+  if (total == 0)
+    return 0;
+  if (total < (1 << 24))
+    return hits * 100 / total;
+  return hits / (total / 100);
+}
+
+void magazine_info_render(string_t *out) {
+  char line[128];
+  string_cat(out, "cpu  alloc_hits alloc_misses  rate  free_hits free_misses  rate\n");
+  for (int cpu = 0; cpu < _ncpu() && cpu < MAX_CPU; ++cpu) {
+    cpu_cache_t *cache = &cpu_caches[cpu];
+    sprintf(line, "%3d %11d %12d %4d%% %10d %11d %4d%%\n", cpu,
+      cache->alloc_hits, cache->alloc_misses,
+      hit_rate(cache->alloc_hits, cache->alloc_misses),
+      cache->free_hits, cache->free_misses,
+      hit_rate(cache->free_hits, cache->free_misses));
+    string_cat(out, line);
+  }
+}
+
+/*------------------------------------------
+                  statistics
+  ------------------------------------------*/
+
+static int size_class(size_t size) {
+  if (!is_page_alloc(size))
+    return mag_class(size);
+  int order = size_order(size);
+  return NR_MAG_CLASSES + (order <= MAX_ORDER ? order : MAX_ORDER);
+}
+
+static int ptr_size_class(void *ptr) {
+  if (is_page_ptr(ptr))
+    return NR_MAG_CLASSES + addr_to_page(ptr)->order;
+  int class = mag_class_of(ptr);
+  return class >= 0 ? class : NR_MAG_CLASSES - 1;
+}
+
+// counters are per CPU, so only interrupts need to be disabled
+static void stat_count(int alloc, int class) {
+  int intr = _intr_read();
+  _intr_write(0);
+  cpu_cache_t *cache = &cpu_caches[_cpu()];
+  if (alloc)
+    cache->nr_alloc[class]++;
+  else
+    cache->nr_free[class]++;
+  _intr_write(intr);
+}
+
+static void meminfo_line(string_t *out, const char *name, int value,
+                         const char *unit) {
+  char line[64];
+  sprintf(line, "%s", name);
+  for (size_t len = strlen(line); len < 16; ++len)
+    strcat(line, " ");
+  sprintf(line + strlen(line), "%10d %s\n", value, unit);
+  string_cat(out, line);
+}
+
+void meminfo_render(string_t *out) {
+  // take a snapshot first, string_cat allocates memory
+  kmt->spin_lock(&buddy_lock);
+  char *brk = pmm_brk;
+  size_t free_pages = nr_free_pages;
+  int free_page_blocks = nr_free_page_blocks;
+  int largest_order = MAX_ORDER;
+  while (largest_order >= 0 && free_area[largest_order] == NULL)
+    largest_order--;
+  kmt->spin_unlock(&buddy_lock);
+
+  kmt->spin_lock(&pmm_lock);
+  size_t fl_free = freelist_free_bytes;
+  int fl_nr_free = freelist_nr_free;
+  size_t fl_chunks = freelist_chunk_bytes;
+  size_t fl_largest = freelist_largest();
+  kmt->spin_unlock(&pmm_lock);
+
+  size_t cached = 0;
+  int nr_alloc[NR_SIZE_CLASSES], nr_free[NR_SIZE_CLASSES];
+  memset(nr_alloc, 0, sizeof(nr_alloc));
+  memset(nr_free, 0, sizeof(nr_free));
+  for (int cpu = 0; cpu < _ncpu() && cpu < MAX_CPU; ++cpu) {
+    cpu_cache_t *cache = &cpu_caches[cpu];
+    for (int class = 0; class < NR_MAG_CLASSES; ++class)
+      cached += cache->mags[class].nr * mag_class_size(class);
+    for (int class = 0; class < NR_SIZE_CLASSES; ++class) {
+      nr_alloc[class] += cache->nr_alloc[class];
+      nr_free[class] += cache->nr_free[class];
+    }
+  }
+
+  // memory beyond brk is free as one block
+  size_t total = page_end - page_base;
+  size_t unused = page_end - brk;
+  size_t free = unused + free_pages * PGSIZE + fl_free;
+  int free_blocks = free_page_blocks + fl_nr_free + (unused > 0 ? 1 : 0);
+  size_t largest = unused;
+  if (largest_order >= 0 && order_size(largest_order) > largest)
+    largest = order_size(largest_order);
+  if (fl_largest > largest)
+    largest = fl_largest;
+  // 1 - largest / free, in percent
+  int frag = 0;
+  if (free >= 1024)
+    frag = 100 - (int)((largest >> 10) * 100 / (free >> 10));
+
+  meminfo_line(out, "MemTotal:", total >> 10, "kB");
+  meminfo_line(out, "MemUsed:", (total - free) >> 10, "kB");
+  meminfo_line(out, "MemFree:", free >> 10, "kB");
+  meminfo_line(out, "SbrkHighWater:", (brk - page_base) >> 10, "kB");
+  meminfo_line(out, "PageFree:", (free_pages * PGSIZE) >> 10, "kB");
+  meminfo_line(out, "FreelistChunks:", fl_chunks >> 10, "kB");
+  meminfo_line(out, "FreelistFree:", fl_free >> 10, "kB");
+  meminfo_line(out, "MagazineCached:", cached >> 10, "kB");
+  meminfo_line(out, "FreeBlocks:", free_blocks, "");
+  meminfo_line(out, "LargestFree:", largest >> 10, "kB");
+  meminfo_line(out, "Fragmentation:", frag, "%");
+
+  char line[64];
+  string_cat(out, "\nsize          allocs      frees\n");
+  for (int class = 0; class < NR_SIZE_CLASSES; ++class) {
+    if (class < NR_MAG_CLASSES)
+      sprintf(line, "%6dB %11d %10d\n", mag_class_size(class),
+        nr_alloc[class], nr_free[class]);
+    else
+      sprintf(line, "%6dK %11d %10d\n",
+        order_size(class - NR_MAG_CLASSES) >> 10,
+        nr_alloc[class], nr_free[class]);
+    string_cat(out, line);
+  }
+}
+
+/*------------------------------------------
+                    trace
+  ------------------------------------------*/
+
+#ifdef DEBUG_MEM
+
+// Alloc and free events go into a ring buffer, and live
+// allocations are accounted to the call site that made them.
+#define NR_TRACE  1024
+#define NR_LIVE   4096    // power of 2
+#define NR_SITES  256     // power of 2
+
+enum { TRACE_ALLOC, TRACE_FREE };
+
+typedef struct trace_event {
+  void *addr;
+  void *caller;
+  uint32_t size;
+  uint32_t time;    // kilocycles since the first event
+  int32_t tid;      // up to MAX_TID, -1 before threads run
+  int16_t type;
+} trace_event_t;
+
+typedef struct live_entry {
+  void *addr;
+  void *caller;
+  uint32_t size;
+} live_entry_t;
+
+typedef struct site_entry {
+  void *caller;
+  int nr_live;
+  uint32_t live_bytes;
+  int nr_alloc;
+} site_entry_t;
+
+static spinlock_t trace_lock = SPINLOCK_INIT("trace_lock");
+static trace_event_t trace_ring[NR_TRACE];
+static uint32_t trace_seq = 0;
+static uint64_t trace_base = 0;
+static live_entry_t live_table[NR_LIVE];
+static site_entry_t site_table[NR_SITES];
+static int nr_untracked = 0;
+
+static inline uint32_t ptr_hash(void *ptr) {
+  return ((uintptr_t)ptr >> 3) * 2654435761u;
+}
+
+static site_entry_t *site_lookup(void *caller) {
+  uint32_t i = ptr_hash(caller) & (NR_SITES - 1);
+  for (int n = 0; n < NR_SITES; ++n, i = (i + 1) & (NR_SITES - 1)) {
+    if (site_table[i].caller == caller)
+      return &site_table[i];
+    if (site_table[i].caller == NULL) {
+      site_table[i].caller = caller;
+      return &site_table[i];
+    }
+  }
+  return NULL;
+}
+
+static int live_add(void *addr, void *caller, size_t size) {
+  uint32_t i = ptr_hash(addr) & (NR_LIVE - 1);
+  for (int n = 0; n < NR_LIVE; ++n, i = (i + 1) & (NR_LIVE - 1)) {
+    if (live_table[i].addr == NULL) {
+      live_table[i].addr = addr;
+      live_table[i].caller = caller;
+      live_table[i].size = size;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+// Linear probing without tombstones, so entries after
+// the removed one are shifted back to fill the hole.
+static int live_remove(void *addr, live_entry_t *out) {
+  uint32_t i = ptr_hash(addr) & (NR_LIVE - 1);
+  int n;
+  for (n = 0; n < NR_LIVE; ++n, i = (i + 1) & (NR_LIVE - 1)) {
+    if (live_table[i].addr == NULL)
+      return -1;
+    if (live_table[i].addr == addr)
+      break;
+  }
+  if (n == NR_LIVE)
+    return -1;
+  *out = live_table[i];
+
+  uint32_t hole = i;
+  for (i = (i + 1) & (NR_LIVE - 1); live_table[i].addr != NULL;
+       i = (i + 1) & (NR_LIVE - 1)) {
+    uint32_t home = ptr_hash(live_table[i].addr) & (NR_LIVE - 1);
+    // move the entry if its home is not in (hole, i]
+    if (((i - home) & (NR_LIVE - 1)) >= ((i - hole) & (NR_LIVE - 1))) {
+      live_table[hole] = live_table[i];
+      hole = i;
+    }
+  }
+  live_table[hole].addr = NULL;
+  return 0;
+}
+
+static void trace_record(int type, void *addr, size_t size, void *caller) {
+  uint64_t now = rdtsc();
+  int tid = (cur_thread != NULL ? cur_thread->tid : -1);
+
+  kmt->spin_lock(&trace_lock);
+  if (trace_seq == 0)
+    trace_base = now;
+  trace_event_t *ev = &trace_ring[trace_seq++ % NR_TRACE];
+  ev->addr = addr;
+  ev->caller = caller;
+  ev->size = size;
+  ev->time = (uint32_t)((now - trace_base) >> 10);
+  ev->tid = tid;
+  ev->type = type;
+  kmt->spin_unlock(&trace_lock);
+}
+
+static void trace_alloc(void *addr, size_t size, void *caller) {
+  trace_record(TRACE_ALLOC, addr, size, caller);
+
+  kmt->spin_lock(&trace_lock);
+  site_entry_t *site = site_lookup(caller);
+  if (site == NULL || live_add(addr, caller, size) != 0) {
+    nr_untracked++;
+  } else {
+    site->nr_live++;
+    site->live_bytes += size;
+    site->nr_alloc++;
+  }
+  kmt->spin_unlock(&trace_lock);
+}
+
+static void trace_free(void *addr, void *caller) {
+  live_entry_t entry;
+  size_t size = 0;
+
+  kmt->spin_lock(&trace_lock);
+  if (live_remove(addr, &entry) == 0) {
+    site_entry_t *site = site_lookup(entry.caller);
+    site->nr_live--;
+    site->live_bytes -= entry.size;
+    size = entry.size;
+  }
+  kmt->spin_unlock(&trace_lock);
+
+  trace_record(TRACE_FREE, addr, size, caller);
+}
+
+// The snapshot is taken into memory allocated beforehand,
+// since rendering allocates and would record new events.
+void memtrace_render(string_t *out) {
+  trace_event_t *snap = arena_alloc(thread_arena(), sizeof(trace_ring));
+  if (snap == NULL)
+    return;
+
+  kmt->spin_lock(&trace_lock);
+  uint32_t end = trace_seq;
+  memcpy(snap, trace_ring, sizeof(trace_ring));
+  kmt->spin_unlock(&trace_lock);
+
+  uint32_t start = (end > NR_TRACE ? end - NR_TRACE : 0);
+  char line[128];
+  string_cat(out, "seq        type  addr       size       caller     tid  kcycles\n");
+  for (uint32_t seq = start; seq < end; ++seq) {
+    trace_event_t *ev = &snap[seq % NR_TRACE];
+    sprintf(line, "%10d %s 0x%08x %10d 0x%08x %4d %d\n", seq,
+      ev->type == TRACE_ALLOC ? "alloc" : "free ",
+      ev->addr, ev->size, ev->caller, ev->tid, ev->time);
+    string_cat(out, line);
+  }
+}
+
+// Call sites that still own memory, the largest first.
+void memleak_render(string_t *out) {
+  site_entry_t *snap = arena_alloc(thread_arena(), sizeof(site_table));
+  if (snap == NULL)
+    return;
+
+  kmt->spin_lock(&trace_lock);
+  memcpy(snap, site_table, sizeof(site_table));
+  int untracked = nr_untracked;
+  kmt->spin_unlock(&trace_lock);
+
+  int nr_live = 0;
+  uint32_t live_bytes = 0;
+  for (int i = 0; i < NR_SITES; ++i) {
+    nr_live += snap[i].nr_live;
+    live_bytes += snap[i].live_bytes;
+  }
+
+  char line[128];
+  sprintf(line, "live %d objects, %d bytes, %d untracked\n\n",
+    nr_live, live_bytes, untracked);
+  string_cat(out, line);
+  string_cat(out, "caller        live objs  live bytes     allocs\n");
+  while (1) {
+    site_entry_t *max = NULL;
+    for (int i = 0; i < NR_SITES; ++i) {
+      if (snap[i].nr_live > 0 &&
+          (max == NULL || snap[i].live_bytes > max->live_bytes))
+        max = &snap[i];
+    }
+    if (max == NULL)
+      break;
+    sprintf(line, "0x%08x %12d %11d %10d\n", max->caller,
+      max->nr_live, max->live_bytes, max->nr_alloc);
+    string_cat(out, line);
+    max->nr_live = 0;
+  }
+}
+
+#else
+
+static inline void trace_alloc(void *addr, size_t size, void *caller) { }
+static inline void trace_free(void *addr, void *caller) { }
+
+#endif
+
+/*------------------------------------------
+                    pmm
+  ------------------------------------------*/
 
 static void pmm_init() {
-  pmm_brk = addr_aligned((char *)_heap.start, sizeof(Header));
+  buddy_init();
+  pmm_add_shrinker("magazine", SHRINK_PRI_MAGAZINE, magazine_shrink);
+  pmm_add_shrinker("slab", SHRINK_PRI_SLAB, slab_shrink);
+  pmm_add_shrinker("freelist", SHRINK_PRI_FREELIST, freelist_shrink);
   Log("pmm_brk initialized as %p", pmm_brk);
   Log("_heap = [%08x, %08x)", _heap.start, _heap.end);
 }
 
-// Thread unsafe, but it is not interface
+// Thread unsafe, but it is not interface.
+// Only buddy extends heap, holding buddy_lock.
 static void *pmm_sbrk(int incr) {
   char *old_brk = pmm_brk;
 
-  if ((incr < 0) || (pmm_brk + incr > (char *)_heap.end)) {
-    Panic("ERROR: pmm_sbrk failed. Ran out of memory.\n");
+  if ((incr < 0) || (pmm_brk + incr > (char *)_heap.end))
     return (void *)-1;
-  }
 
   pmm_brk += incr;
   return (void *)old_brk;
 }
 
-static void *pmm_alloc(size_t size) {
-  kmt->spin_lock(&pmm_lock);
-  
-  void *ret = addr_aligned_alloc(size);
+// Shrinkers are tried one by one before giving up.
+static void *do_alloc(size_t size, void *caller) {
+  void *ret;
+  int next = 0;
 
-#ifdef DEBUG_MEM
-  Log("addr: %p, size: %d", ret, size);
-#endif
+  if (is_page_alloc(size) && size_order(size) > MAX_ORDER)
+    return NULL;
+  do {
+    if (is_page_alloc(size))
+      ret = buddy_alloc(size_order(size));
+    else
+      ret = magazine_alloc(size);
+  } while (ret == NULL && reclaim(&next));
+  if (ret != NULL) {
+    stat_count(1, size_class(size));
+    trace_alloc(ret, size, caller);
+  }
 
-  kmt->spin_unlock(&pmm_lock);
   return ret;
 }
 
-static void pmm_free(void *ptr) {
+static void do_free(void *ptr, void *caller) {
   Assert(ptr != NULL);
-  kmt->spin_lock(&pmm_lock);
+  stat_count(0, ptr_size_class(ptr));
+  trace_free(ptr, caller);
 
-  freelist_free(ptr);
+  if (is_page_ptr(ptr))
+    buddy_free(ptr);
+  else
+    magazine_free(ptr);
+}
 
-#ifdef DEBUG_MEM
-  Log("addr: %p", ptr);
-#endif
+static void *pmm_alloc(size_t size) {
+  return do_alloc(size, __builtin_return_address(0));
+}
 
-  kmt->spin_unlock(&pmm_lock);
+static void pmm_free(void *ptr) {
+  do_free(ptr, __builtin_return_address(0));
+}
+
+static size_t pmm_usable_size(void *ptr) {
+  if (is_page_ptr(ptr))
+    return order_size(addr_to_page(ptr)->order);
+  return block_size((Header *)ptr - 1) - sizeof(Header);
+}
+
+// Try to grow in place first, move the data otherwise.
+static void *pmm_realloc(void *ptr, size_t size) {
+  void *caller = __builtin_return_address(0);
+  if (ptr == NULL)
+    return do_alloc(size, caller);
+  if (size == 0) {
+    do_free(ptr, caller);
+    return NULL;
+  }
+
+  size_t old_size = pmm_usable_size(ptr);
+  if (size <= old_size)
+    return ptr;
+  // ptr is left alone, as on any other failure
+  if (is_page_alloc(size) && size_order(size) > MAX_ORDER)
+    return NULL;
+
+  // growing in place counts as a free and an alloc, like a move
+  int old_class = ptr_size_class(ptr);
+  int ok;
+  if (is_page_ptr(ptr)) {
+    ok = (buddy_grow_inplace(ptr, size_order(size)) == 0);
+  } else if (is_page_alloc(size)) {
+    ok = 0;
+  } else {
+    kmt->spin_lock(&pmm_lock);
+    ok = (freelist_grow_inplace(ptr, size) == 0);
+    kmt->spin_unlock(&pmm_lock);
+  }
+
+  if (ok) {
+    stat_count(0, old_class);
+    stat_count(1, size_class(size));
+    trace_free(ptr, caller);
+    trace_alloc(ptr, size, caller);
+    return ptr;
+  }
+
+  void *new_ptr = do_alloc(size, caller);
+  if (new_ptr == NULL)
+    return NULL;
+  memcpy(new_ptr, ptr, old_size);
+  do_free(ptr, caller);
+  return new_ptr;
+}
+
+static void *pmm_alloc_pages(int order) {
+  void *ret;
+  int next = 0;
+
+  if (order < 0 || order > MAX_ORDER)
+    return NULL;
+  do {
+    ret = buddy_alloc(order);
+  } while (ret == NULL && reclaim(&next));
+  if (ret != NULL)
+    trace_alloc(ret, order_size(order), __builtin_return_address(0));
+  return ret;
+}
+
+static void pmm_free_pages(void *ptr) {
+  Assert(ptr != NULL);
+  trace_free(ptr, __builtin_return_address(0));
+  buddy_free(ptr);
 }
\ No newline at end of file
@@ -29,7 +29,16 @@ static int parse_int(const char **pfmt) {
   return num;
 }
 
-static int print_int(int x, int base, int sgn,
+// If out is NULL, characters go to the console,
+// otherwise they are appended to *out.
+static inline void outc(char **out, char ch) {
+  if (out == NULL)
+    _putc(ch);
+  else
+    *(*out)++ = ch;
+}
+
+static int print_int(char **out, int x, int base, int sgn,
   char flag, int width, int prec, char length) {
   // not enable prec, length
   if (prec || length)
@@ -60,12 +69,12 @@ static int print_int(int x, int base, int sgn,
     buf[i++] = (flag == '0' ? '0' : ' ');
   
   while(--i >= 0)
-    _putc(buf[i]);
+    outc(out, buf[i]);
  
   return 0;
 }
 
-static int print_str(const char *str,
+static int print_str(char **out, const char *str,
   char flag, int width, int prec, char length) {
   // not enable flag, width, prec, length
   if (flag || width || prec || length)
@@ -74,30 +83,28 @@ static int print_str(const char *str,
   if (str == NULL)
     str = "(null)";
   while (*str)
-    _putc(*str++);
+    outc(out, *str++);
   return 0;
 }
 
-static int print_char(char ch,
+static int print_char(char **out, char ch,
   char flag, int width, int prec, char length) {
     // not enable flag, width, prec, length
     if (flag || width || prec || length)
       return -1;
 
-    _putc(ch);
+    outc(out, ch);
     return 0;
 }
 
-int printf(const char *fmt, ...) {
+static int vformat(char **out, const char *fmt, va_list ap) {
   char flag, length;
   int width, prec, error;
   const char *mark;
-  va_list ap;
-  va_start(ap, fmt);
 
   while (*fmt) {
     if (*fmt != '%') {
-      _putc(*fmt++);
+      outc(out, *fmt++);
     }
     else {
       mark = fmt++;
@@ -121,22 +128,22 @@ int printf(const char *fmt, ...) {
 
       switch (*fmt) {
         case '%':
-          _putc('%'); break;
+          outc(out, '%'); break;
 
         case 'd':
-          error = print_int(va_arg(ap, int), 10, 1, 
+          error = print_int(out, va_arg(ap, int), 10, 1, 
             flag, width, prec, length); break;
 
         case 'x': case 'X': case 'p':
-          error = print_int(va_arg(ap, int), 16, 0,
+          error = print_int(out, va_arg(ap, int), 16, 0,
             flag, width, prec, length); break;
 
         case 'c': 
-          error = print_char((char)va_arg(ap, int),
+          error = print_char(out, (char)va_arg(ap, int),
             flag, width, prec, length); break;
 
         case 's': 
-          error = print_str(va_arg(ap, const char *),
+          error = print_str(out, va_arg(ap, const char *),
             flag, width, prec, length); break;
 
         default:  
@@ -149,19 +156,31 @@ int printf(const char *fmt, ...) {
       // if not implemented or can't parse format
       if (error) 
         while (mark != fmt) 
-          _putc(*mark++);
+          outc(out, *mark++);
     } 
   }
 
-  va_end(ap);
   return 0;
 }
 
-/*
-int sprintf(char* out, const char* format, ...) {
+int printf(const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  vformat(NULL, fmt, ap);
+  va_end(ap);
+  return 0;
+}
 
+// Caller should make sure that out is big enough.
+int sprintf(char *out, const char *format, ...) {
+  char *start = out;
+  va_list ap;
+  va_start(ap, format);
+  vformat(&out, format, ap);
+  va_end(ap);
+  *out = '\0';
+  return out - start;
 }
-*/
 
 static const char keycode[] = 
 "??????????????"
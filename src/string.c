@@ -1,22 +1,36 @@
 #include "os.h"
 #include "common.h"
 
-static void string_resize(string_t *s, size_t capacity) {
+// pmm->realloc grows the buffer in place when it can,
+// on failure the old buffer is left untouched
+static int string_resize(string_t *s, size_t capacity) {
   Assert(s != NULL);
   Assert(capacity >= s->size);
-  char *temp = pmm->alloc(capacity);
-  for (size_t i = 0; i < s->size; ++i)
-    temp[i] = s->data[i];
-  pmm->free(s->data);
+  char *temp = pmm->realloc(s->data, capacity);
+  if (temp == NULL)
+    return -1;
   s->data = temp;
   s->capacity = capacity;
+  return 0;
 }
 
-static void string_push_back(string_t *s, char ch) {
+static int string_reserve(string_t *s, size_t capacity) {
   Assert(s != NULL);
-  if (s->size == s->capacity)
-    string_resize(s, 2 * s->capacity);
-  s->data[s->size++] = ch;
+  if (capacity <= s->capacity)
+    return 0;
+  // doubling may ask for more than is left, the exact size may still fit
+  if (capacity < 2 * s->capacity &&
+      string_resize(s, 2 * s->capacity) == 0)
+    return 0;
+  return string_resize(s, capacity);
+}
+
+static int string_append(string_t *s, const char *buf, size_t size) {
+  if (string_reserve(s, s->size + size) != 0)
+    return -1;
+  memcpy(s->data + s->size, buf, size);
+  s->size += size;
+  return 0;
 }
 
 void string_init(string_t *s) {
@@ -25,56 +39,63 @@ void string_init(string_t *s) {
   Assert(s->data != NULL);
   s->capacity = 2;
   s->size = 0;
-  kmt->spin_init(&s->lock, "string_lock");
+  kmt->mutex_init(&s->lock, "string_lock");
 }
 
 int string_empty(string_t *s) {
   Assert(s != NULL);
-  kmt->spin_lock(&s->lock);
+  kmt->mutex_lock(&s->lock);
   int is_empty = (s->size == 0);
-  kmt->spin_unlock(&s->lock);
+  kmt->mutex_unlock(&s->lock);
   return is_empty;
 }
 
 size_t string_length(string_t *s) {
   Assert(s != NULL);
-  kmt->spin_lock(&s->lock);
+  kmt->mutex_lock(&s->lock);
   size_t length = s->size;
-  kmt->spin_unlock(&s->lock);
+  kmt->mutex_unlock(&s->lock);
   return length;
 }
 
 size_t string_capacity(string_t *s) {
   Assert(s != NULL);
-  kmt->spin_lock(&s->lock);
+  kmt->mutex_lock(&s->lock);
   size_t capacity = s->capacity;
-  kmt->spin_unlock(&s->lock);
+  kmt->mutex_unlock(&s->lock);
   return capacity;
 }
 
-void string_cat(string_t *s1, const char *s2) {
+int string_cat(string_t *s1, const char *s2) {
   Assert(s1 != NULL && s2 != NULL);
-  kmt->spin_lock(&s1->lock);
-  while (*s2)
-    string_push_back(s1, *s2++);
-  kmt->spin_unlock(&s1->lock);
+  kmt->mutex_lock(&s1->lock);
+  int ret = string_append(s1, s2, strlen(s2));
+  kmt->mutex_unlock(&s1->lock);
+  return ret;
+}
+
+void string_clear(string_t *s) {
+  Assert(s != NULL);
+  kmt->mutex_lock(&s->lock);
+  s->size = 0;
+  kmt->mutex_unlock(&s->lock);
 }
 
 void string_destroy(string_t *s) {
   Assert(s != NULL);
-  kmt->spin_lock(&s->lock);
+  kmt->mutex_lock(&s->lock);
   pmm->free(s->data);
   s->size = 0;
   s->capacity = 0;
-  kmt->spin_unlock(&s->lock);
+  kmt->mutex_unlock(&s->lock);
 }
 
 void string_print(string_t *s) {
   Assert(s != NULL);
-  kmt->spin_lock(&s->lock);
+  kmt->mutex_lock(&s->lock);
   for (size_t i = 0; i < s->size; ++i)
     _putc(s->data[i]);
-  kmt->spin_unlock(&s->lock);
+  kmt->mutex_unlock(&s->lock);
 }
 
 ssize_t string_read(string_t *s, off_t offset, void *buf, size_t size) {
@@ -82,55 +103,55 @@ ssize_t string_read(string_t *s, off_t offset, void *buf, size_t size) {
   ssize_t nread = 0;
   char *bufp = buf;
 
-  kmt->spin_lock(&s->lock);
+  kmt->mutex_lock(&s->lock);
   while (nleft > 0 && (size_t)offset < s->size) {
     *bufp++ = s->data[offset++];
     nleft--;
     nread++;
   }
-  kmt->spin_unlock(&s->lock);
+  kmt->mutex_unlock(&s->lock);
 
   return nread;
 }
 
+// -1 with the string unchanged when it can't grow
 ssize_t string_write(string_t *s, off_t offset, const void *buf, size_t size) {
-  size_t nleft = size;
-  ssize_t nwritten = 0;
+  size_t noverwrite = 0;
   const char *bufp = buf;
 
-  kmt->spin_lock(&s->lock);
-  while (nleft > 0 && (size_t)offset < s->size) {
-    s->data[offset++] = *bufp++;
-    nleft--;
-    nwritten++;
+  kmt->mutex_lock(&s->lock);
+  if ((size_t)offset < s->size) {
+    noverwrite = s->size - offset;
+    if (noverwrite > size)
+      noverwrite = size;
   }
-
-  while (nleft > 0) {
-    string_push_back(s, *bufp++);
-    nleft--;
-    nwritten++;
+  if (string_reserve(s, s->size + size - noverwrite) != 0) {
+    kmt->mutex_unlock(&s->lock);
+    return -1;
   }
-  kmt->spin_unlock(&s->lock);
+  memcpy(s->data + offset, bufp, noverwrite);
+  string_append(s, bufp + noverwrite, size - noverwrite);
+  kmt->mutex_unlock(&s->lock);
   
-  return nwritten; 
+  return size; 
 }
 
 int string_equal(string_t *s1, const char *s2) {
   Assert(s1 != NULL && s2 != NULL);
-  kmt->spin_lock(&s1->lock);
+  kmt->mutex_lock(&s1->lock);
   const char *data = s1->data;
   size_t i;
   for (i = 0; i < s1->size; ++i) {
     if (!s2[i] || data[i] != s2[i]) {
-      kmt->spin_unlock(&s1->lock);
+      kmt->mutex_unlock(&s1->lock);
       return 0;
     }
   }
   if (s2[i] == '\0') {
-    kmt->spin_unlock(&s1->lock);
+    kmt->mutex_unlock(&s1->lock);
     return 1;
   }
-  kmt->spin_unlock(&s1->lock);
+  kmt->mutex_unlock(&s1->lock);
   return 0;
 }
 
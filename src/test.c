@@ -96,6 +96,131 @@ void debug_test() {
   Panic("debug test panic");
 }
 
+/*------------------------------------------
+                thread group
+  ------------------------------------------*/
+
+// A test starts a group of threads and joins them. A thread
+// whose body returns parks on the group's gate, off the CPU,
+// until the join tears it down.
+typedef struct group_job {
+  void (*body)(void *arg);
+  void *arg;
+  struct group *group;
+} group_job_t;
+
+typedef struct group {
+  int nr;
+  int max;
+  sem_t done;
+  sem_t gate;     // never signaled
+  thread_t *threads;
+  group_job_t *jobs;
+} group_t;
+
+static void group_entry(void *arg) {
+  group_job_t *job = arg;
+  job->body(job->arg);
+  kmt->sem_signal(&job->group->done);
+  kmt->sem_wait(&job->group->gate);
+  Panic("parked thread should be torn down");
+}
+
+static void group_init(group_t *group, const char *name, int max) {
+  group->nr = 0;
+  group->max = max;
+  kmt->sem_init(&group->done, name, 0);
+  kmt->sem_init(&group->gate, name, 0);
+  group->threads = pmm->alloc(max * sizeof(thread_t));
+  group->jobs = pmm->alloc(max * sizeof(group_job_t));
+  Assert(group->threads != NULL && group->jobs != NULL);
+}
+
+// Returns the thread, NULL if kmt refuses to create it.
+static thread_t *group_spawn_attr(group_t *group, const thread_attr_t *attr,
+                                  void (*body)(void *arg), void *arg) {
+  Assert(group->nr < group->max);
+  group_job_t *job = &group->jobs[group->nr];
+  job->body = body;
+  job->arg = arg;
+  job->group = group;
+  thread_t *thread = &group->threads[group->nr];
+  if (kmt->create_attr(thread, attr, group_entry, job) != 0)
+    return NULL;
+  group->nr++;
+  return thread;
+}
+
+static thread_t *group_spawn(group_t *group, void (*body)(void *arg), void *arg) {
+  thread_attr_t attr = THREAD_ATTR_INIT;
+  return group_spawn_attr(group, &attr, body, arg);
+}
+
+// Wait for n more bodies to return.
+static void group_wait(group_t *group, int n) {
+  for (int i = 0; i < n; ++i)
+    kmt->sem_wait(&group->done);
+}
+
+// Wait for every body still running, then tear all down.
+static void group_join(group_t *group, int nr_waited) {
+  group_wait(group, group->nr - nr_waited);
+  for (int i = 0; i < group->nr; ++i)
+    kmt->teardown(&group->threads[i]);
+  pmm->free(group->threads);
+  pmm->free(group->jobs);
+}
+
+/*------------------------------------------
+                  proc utils
+  ------------------------------------------*/
+
+static char proc_buf[16384];
+
+// Read a whole /proc file into proc_buf.
+static const char *proc_read(const char *path) {
+  int fd = vfs->open(path, O_RDONLY);
+  Assert(fd != -1);
+  ssize_t size = vfs->read(fd, proc_buf, sizeof(proc_buf) - 1);
+  Assert(size >= 0);
+  proc_buf[size] = '\0';
+  Assert(vfs->close(fd) == 0);
+  return proc_buf;
+}
+
+// Find the line whose first word is key and parse up to n
+// numbers after it. Returns how many were parsed.
+static int proc_field(const char *text, const char *key, int *vals, int n) {
+  while (*text != '\0') {
+    while (*text == ' ')
+      text++;
+    const char *k = key;
+    while (*k != '\0' && *text == *k) {
+      text++;
+      k++;
+    }
+    if (*k == '\0' && (*text == ' ' || *text == ':')) {
+      int found = 0;
+      while (found < n && *text != '\n' && *text != '\0') {
+        if (*text < '0' || *text > '9') {
+          text++;
+          continue;
+        }
+        vals[found] = 0;
+        while (*text >= '0' && *text <= '9')
+          vals[found] = vals[found] * 10 + (*text++ - '0');
+        found++;
+      }
+      return found;
+    }
+    while (*text != '\n' && *text != '\0')
+      text++;
+    if (*text == '\n')
+      text++;
+  }
+  return 0;
+}
+
 /*------------------------------------------
                   pmm test
   ------------------------------------------*/
@@ -108,6 +233,300 @@ void pmm_test() {
   pmm->free(pmm->alloc(4096));
 }
 
+/*------------------------------------------
+                  buddy test
+  ------------------------------------------*/
+
+int buddy_test() {
+  uint8_t *pages[8];
+  for (int order = 0; order < 8; ++order) {
+    pages[order] = pmm->alloc_pages(order);
+    Assert(pages[order] != NULL);
+    Assert(((intptr_t)pages[order] & ((PGSIZE << order) - 1)) == 0);
+    memset(pages[order], order, PGSIZE << order);
+  }
+  for (int order = 0; order < 8; ++order) {
+    Assert(pages[order][(PGSIZE << order) - 1] == order);
+    pmm->free_pages(pages[order]);
+  }
+
+  // large allocations are served by buddy
+  void *stack = pmm->alloc(MAX_KSTACK_SIZE);
+  Assert(((intptr_t)stack & (MAX_KSTACK_SIZE - 1)) == 0);
+  pmm->free(stack);
+
+  // no block is this large, and the order search must stop
+  Assert(pmm->alloc(0x80000001) == NULL);
+  Assert(pmm->alloc((size_t)-1) == NULL);
+  return 1;
+}
+
+/*------------------------------------------
+                  realloc test
+  ------------------------------------------*/
+
+int realloc_test() {
+  char *p = pmm->alloc(100);
+  memset(p, 'x', 100);
+  for (size_t size = 200; size <= 64 * PGSIZE; size *= 2) {
+    p = pmm->realloc(p, size);
+    Assert(p != NULL);
+    Assert(p[0] == 'x' && p[99] == 'x');
+  }
+  // larger than the largest buddy block, p must stay valid
+  Assert(pmm->realloc(p, (size_t)PGSIZE << 11) == NULL);
+  Assert(pmm->realloc(p, 0x80000001) == NULL);
+  Assert(p[0] == 'x' && p[99] == 'x');
+  pmm->free(p);
+
+  // a file grown by small appends
+  string_t s;
+  string_init(&s);
+  for (int i = 0; i < 10000; ++i)
+    string_write(&s, string_length(&s), "0123456789", 10);
+  Assert(string_length(&s) == 100000);
+  char buf[10];
+  string_read(&s, 99990, buf, 10);
+  Assert(buf[0] == '0' && buf[9] == '9');
+  string_destroy(&s);
+  return 1;
+}
+
+/*------------------------------------------
+                  oom test
+  ------------------------------------------*/
+
+// The test shrinker gives back one reserved page per call.
+#define OOM_RESERVE 8
+static void *oom_reserve[OOM_RESERVE];
+static int oom_nr_reserve, oom_nr_shrinks;
+static spinlock_t oom_lock = SPINLOCK_INIT("oom_lock");
+
+static size_t oom_shrink() {
+  void *page = NULL;
+  kmt->spin_lock(&oom_lock);
+  oom_nr_shrinks++;
+  if (oom_nr_reserve > 0)
+    page = oom_reserve[--oom_nr_reserve];
+  kmt->spin_unlock(&oom_lock);
+  if (page == NULL)
+    return 0;
+  pmm->free_pages(page);
+  return PGSIZE;
+}
+
+// Blocks of every order are chained through their first word.
+static void *oom_fill(void *list, int order) {
+  void *block;
+  while ((block = pmm->alloc_pages(order)) != NULL) {
+    *(void **)block = list;
+    list = block;
+  }
+  return list;
+}
+
+static void oom_entry(void *arg) {
+  Panic("thread should not be created");
+}
+
+int oom_test() {
+  static int registered = 0;
+  if (!registered) {
+    pmm_add_shrinker("oom_test", SHRINK_PRI_FREELIST + 1, oom_shrink);
+    registered = 1;
+  }
+  kmt->spin_lock(&oom_lock);
+  for (oom_nr_reserve = 0; oom_nr_reserve < OOM_RESERVE; ++oom_nr_reserve)
+    oom_reserve[oom_nr_reserve] = pmm->alloc_pages(0);
+  int nr_shrinks = oom_nr_shrinks;
+  kmt->spin_unlock(&oom_lock);
+  for (int i = 0; i < OOM_RESERVE; ++i)
+    Assert(oom_reserve[i] != NULL);
+
+  filesystem_t *kvfs = fs_manager_get("/", NULL);
+  inode_manager_lookup(&kvfs->inode_manager, "/tmp/oom", INODE_FILE, 1, DEFAULT_MODE);
+  int fd = vfs->open("/tmp/oom", O_RDWR);
+  Assert(fd != -1);
+  Assert(vfs->write(fd, "oom", 3) == 3);
+  char *p = pmm->alloc(16);
+  strcpy(p, "oom");
+
+  // take everything, largest blocks first
+  void *list = NULL;
+  for (int order = 8; order >= 0; --order)
+    list = oom_fill(list, order);
+  Assert(list != NULL);
+
+  // the shrinker ran and its pages went to the last allocations
+  kmt->spin_lock(&oom_lock);
+  Assert(oom_nr_shrinks > nr_shrinks);
+  Assert(oom_nr_reserve == 0);
+  kmt->spin_unlock(&oom_lock);
+
+  // every failure is reported and leaves the old state behind
+  Assert(pmm->alloc_pages(0) == NULL);
+  Assert(pmm->realloc(p, 16 * PGSIZE) == NULL);
+  Assert(strcmp(p, "oom") == 0);
+  thread_t thread;
+  Assert(kmt->create(&thread, oom_entry, NULL) == -1);
+  Assert(vfs->write(fd, list, 16 * PGSIZE) == -1);
+  Assert(vfs->lseek(fd, 0, SEEK_END) == 3);
+
+  while (list != NULL) {
+    void *next = *(void **)list;
+    pmm->free_pages(list);
+    list = next;
+  }
+  pmm->free(p);
+
+  // and allocation works again
+  void *block = pmm->alloc_pages(8);
+  Assert(block != NULL);
+  Assert(vfs->write(fd, block, 16 * PGSIZE) == 16 * PGSIZE);
+  pmm->free_pages(block);
+  Assert(vfs->close(fd) == 0);
+  return 1;
+}
+
+/*------------------------------------------
+                  slab test
+  ------------------------------------------*/
+
+#define NR_SLAB_OBJS 200
+
+int slab_test() {
+  slab_cache_t cache;
+  void *objs[NR_SLAB_OBJS];
+  slab_cache_init(&cache, "test_cache", 100);
+
+  for (int i = 0; i < NR_SLAB_OBJS; ++i) {
+    objs[i] = slab_cache_alloc(&cache);
+    Assert(objs[i] != NULL);
+    Assert(((intptr_t)objs[i] & 7) == 0);
+    memset(objs[i], i, 100);
+  }
+  Assert(cache.nobjs == NR_SLAB_OBJS);
+  Assert(cache.nslabs > 1);
+  for (int i = 0; i < NR_SLAB_OBJS; ++i)
+    Assert(((uint8_t *)objs[i])[99] == (uint8_t)i);
+
+  for (int i = 0; i < NR_SLAB_OBJS; i += 2)
+    slab_cache_free(&cache, objs[i]);
+  for (int i = 0; i < NR_SLAB_OBJS; i += 2)
+    objs[i] = slab_cache_alloc(&cache);
+  for (int i = 0; i < NR_SLAB_OBJS; ++i)
+    slab_cache_free(&cache, objs[i]);
+  Assert(cache.nobjs == 0);
+  Assert(cache.nslabs == 1);
+  Assert(slab_cache_shrink(&cache) == PGSIZE);
+  Assert(cache.nslabs == 0);
+  slab_cache_destroy(&cache);
+  Assert(cache.nslabs == 0);
+  return 1;
+}
+
+/*------------------------------------------
+                magazine test
+  ------------------------------------------*/
+
+#define NR_MAG_OBJS   64    // more than a magazine holds
+#define MAG_OBJ_SIZE  64
+
+// alloc_hits alloc_misses rate free_hits free_misses rate
+#define NR_MAG_FIELDS 6
+enum { MAG_AHIT, MAG_AMISS, MAG_ARATE, MAG_FHIT, MAG_FMISS, MAG_FRATE };
+
+static uint8_t *mag_objs[NR_MAG_OBJS];
+
+static void mag_stats(int cpu, int *vals) {
+  char key[16];
+  itoa(cpu, 10, 1, key);
+  Assert(proc_field(proc_read("/proc/magazines"), key, vals, NR_MAG_FIELDS) ==
+         NR_MAG_FIELDS);
+  Assert(vals[MAG_ARATE] <= 100 && vals[MAG_FRATE] <= 100);
+}
+
+// Interrupts stay off, so nothing else uses this CPU's magazines.
+static void mag_allocator(void *arg) {
+  _intr_write(0);
+  for (int i = 0; i < NR_MAG_OBJS; ++i) {
+    mag_objs[i] = pmm->alloc(MAG_OBJ_SIZE);
+    Assert(mag_objs[i] != NULL);
+    memset(mag_objs[i], i, MAG_OBJ_SIZE);
+  }
+  _intr_write(1);
+}
+
+static void mag_freer(void *arg) {
+  _intr_write(0);
+  for (int i = 0; i < NR_MAG_OBJS; ++i) {
+    Assert(mag_objs[i][MAG_OBJ_SIZE - 1] == (uint8_t)i);
+    pmm->free(mag_objs[i]);
+  }
+  // served from the magazine just filled
+  pmm->free(pmm->alloc(MAG_OBJ_SIZE));
+  _intr_write(1);
+}
+
+// Blocks allocated on one CPU and freed on another refill the
+// first CPU's magazines and flush the second one's.
+int magazine_test() {
+  int from = 0, to = (_ncpu() > 1 ? 1 : 0);
+  int from0[NR_MAG_FIELDS], to0[NR_MAG_FIELDS];
+  int from1[NR_MAG_FIELDS], to1[NR_MAG_FIELDS];
+  thread_attr_t attr = THREAD_ATTR_INIT;
+  group_t group;
+
+  mag_stats(from, from0);
+  mag_stats(to, to0);
+  group_init(&group, "magazine_done", 2);
+  attr.pin_cpu = from;
+  group_spawn_attr(&group, &attr, mag_allocator, NULL);
+  group_wait(&group, 1);
+  attr.pin_cpu = to;
+  group_spawn_attr(&group, &attr, mag_freer, NULL);
+  group_join(&group, 1);
+  mag_stats(from, from1);
+  mag_stats(to, to1);
+
+  // a magazine can't hold every object, so there were refills
+  // between the hits, and flushes between the free hits
+  Assert(from1[MAG_AMISS] > from0[MAG_AMISS]);
+  Assert(from1[MAG_AHIT] > from0[MAG_AHIT]);
+  Assert(to1[MAG_FMISS] > to0[MAG_FMISS]);
+  Assert(to1[MAG_FHIT] > to0[MAG_FHIT]);
+  Assert(to1[MAG_AHIT] > to0[MAG_AHIT]);
+  return 1;
+}
+
+int arena_test() {
+  arena_t *arena = arena_create();
+  Assert(arena != NULL);
+
+  for (int round = 0; round < 2; ++round) {
+    char *small[64];
+    for (int i = 0; i < 64; ++i) {
+      small[i] = arena_alloc(arena, 100);
+      Assert(small[i] != NULL);
+      Assert(((intptr_t)small[i] & 7) == 0);
+      memset(small[i], i, 100);
+    }
+    // bigger than a page, gets its own block
+    char *big = arena_alloc(arena, 3 * PGSIZE);
+    Assert(big != NULL);
+    memset(big, 0xff, 3 * PGSIZE);
+    for (int i = 0; i < 64; ++i)
+      Assert(small[i][99] == i);
+    arena_reset(arena);
+  }
+  arena_destroy(arena);
+
+  Assert(thread_arena() == thread_arena());
+  Assert(arena_alloc(thread_arena(), 16) != NULL);
+  arena_reset(thread_arena());
+  return 1;
+}
+
 /*------------------------------------------
                 schedule test
   ------------------------------------------*/
@@ -151,6 +570,391 @@ void schedule_test() {
   kmt->create(&c, print_number, NULL);
 }
 
+/*------------------------------------------
+                  smp test
+  ------------------------------------------*/
+
+static int smp_wrong_cpu = 0;
+
+static void check_cpu(void *arg) {
+  int cpu = (int)(intptr_t)arg;
+  for (int volatile i = 0; i < 100000; ++i) {
+    _intr_write(0);
+    if (_cpu() != cpu)
+      smp_wrong_cpu = 1;
+    _intr_write(1);
+  }
+}
+
+int smp_test() {
+  group_t group;
+  group_init(&group, "smp_done", _ncpu());
+  for (int cpu = 0; cpu < _ncpu(); ++cpu) {
+    thread_attr_t attr = THREAD_ATTR_INIT;
+    attr.pin_cpu = cpu;
+    group_spawn_attr(&group, &attr, check_cpu, (void *)(intptr_t)cpu);
+  }
+  group_join(&group, 0);
+  Assert(smp_wrong_cpu == 0);
+  return 1;
+}
+
+#define NR_WORKERS 16
+
+static int worker_cpus[NR_WORKERS];
+
+static void worker(void *arg) {
+  int id = (int)(intptr_t)arg;
+  for (int volatile i = 0; i < 1000000; ++i)
+    continue;
+  _intr_write(0);
+  worker_cpus[id] = _cpu();
+  _intr_write(1);
+}
+
+// schedules column of every cpu line in /proc/schedstat
+static void read_schedules(int *schedules) {
+  const char *text = proc_read("/proc/schedstat");
+  for (int cpu = 0; cpu < _ncpu(); ++cpu) {
+    char key[8];
+    int vals[2];
+    itoa(cpu, 10, 1, key);
+    Assert(proc_field(text, key, vals, 2) == 2);
+    schedules[cpu] = vals[1];
+  }
+}
+
+// Workers that never block keep every run queue busy, so
+// each of them finishes only if queues are served fairly.
+int runqueue_test() {
+  int before[MAX_CPU], after[MAX_CPU];
+  read_schedules(before);
+
+  group_t group;
+  group_init(&group, "workers_done", NR_WORKERS);
+  for (int i = 0; i < NR_WORKERS; ++i)
+    group_spawn(&group, worker, (void *)(intptr_t)i);
+  group_join(&group, 0);
+
+  int used[MAX_CPU] = { 0 }, nr_used = 0;
+  for (int i = 0; i < NR_WORKERS; ++i)
+    used[worker_cpus[i]] = 1;
+  for (int cpu = 0; cpu < _ncpu(); ++cpu)
+    nr_used += used[cpu];
+  printf("workers ran on %d of %d cpus\n", nr_used, _ncpu());
+  if (_ncpu() > 1)
+    Assert(nr_used > 1);
+
+  // every cpu that ran a worker scheduled since
+  read_schedules(after);
+  for (int cpu = 0; cpu < _ncpu(); ++cpu)
+    if (used[cpu])
+      Assert(after[cpu] > before[cpu]);
+  return 1;
+}
+
+#define NR_SLEEPERS 64
+
+static sem_t sleepers_gate;
+
+static void sleeper(void *arg) {
+  kmt->sem_wait(&sleepers_gate);
+}
+
+// Blocked threads stay off the run queues, so a crowd of
+// sleepers must neither starve nor lose any of them.
+int blocked_test() {
+  group_t group;
+  group_init(&group, "sleepers_done", NR_SLEEPERS);
+  kmt->sem_init(&sleepers_gate, "sleepers_gate", 0);
+  for (int i = 0; i < NR_SLEEPERS; ++i)
+    group_spawn(&group, sleeper, NULL);
+  for (int i = 0; i < NR_SLEEPERS; ++i)
+    kmt->sem_signal(&sleepers_gate);
+  group_join(&group, 0);
+  return 1;
+}
+
+static sem_t waiter_ready;
+static sem_t waiter_gate;
+
+static void waiter(void *arg) {
+  kmt->sem_signal(&waiter_ready);
+  kmt->sem_wait(&waiter_gate);
+  Panic("waiter should be torn down");
+}
+
+// A thread torn down while it waits leaves the semaphore usable.
+int waitqueue_test() {
+  thread_t thread;
+  kmt->sem_init(&waiter_ready, "waiter_ready", 0);
+  kmt->sem_init(&waiter_gate, "waiter_gate", 0);
+  kmt->create(&thread, waiter, NULL);
+  kmt->sem_wait(&waiter_ready);
+  kmt->teardown(&thread);
+  Assert(waitqueue_empty(&waiter_gate.queue));
+  kmt->sem_signal(&waiter_gate);
+  kmt->sem_wait(&waiter_gate);
+  return 1;
+}
+
+static volatile int hogs_stop;
+
+static void hog(void *arg) {
+  while (!hogs_stop)
+    continue;
+}
+
+static void batch(void *arg) {
+  for (int volatile i = 0; i < 1000000; ++i)
+    continue;
+}
+
+// A thread at the lowest priority still finishes while a hog
+// at the highest one keeps every CPU busy.
+int mlfq_test() {
+  group_t group;
+  thread_attr_t attr = THREAD_ATTR_INIT;
+  group_init(&group, "batch_done", _ncpu() + 1);
+
+  attr.priority = NR_PRIO;
+  Assert(group_spawn_attr(&group, &attr, batch, NULL) == NULL);
+
+  hogs_stop = 0;
+  attr.priority = NR_PRIO - 1;
+  thread_t *low = group_spawn_attr(&group, &attr, batch, NULL);
+  Assert(low != NULL);
+  Assert(kmt->set_priority(low, NR_PRIO) == -1);
+  Assert(kmt->set_priority(low, NR_PRIO - 1) == 0);
+  for (int cpu = 0; cpu < _ncpu(); ++cpu)
+    group_spawn(&group, hog, NULL);
+
+  // only the batch thread can finish while hogs run
+  group_wait(&group, 1);
+  hogs_stop = 1;
+  thread_t copy = *low;
+  group_join(&group, 1);
+  Assert(kmt->set_priority(&copy, 0) == -1);
+  return 1;
+}
+
+#define STRIDE_SPINS 50000000
+
+static volatile int stride_stop;
+static volatile int stride_spins[2];
+
+static void stride_worker(void *arg) {
+  int id = (int)(intptr_t)arg;
+  while (!stride_stop) {
+    stride_spins[id]++;
+    if (stride_spins[id] == STRIDE_SPINS)
+      stride_stop = 1;
+  }
+}
+
+// Two stride threads on one CPU with 3:1 tickets.
+int stride_test() {
+  group_t group;
+  thread_attr_t attr = THREAD_ATTR_INIT;
+  attr.pin_cpu = 0;
+  attr.policy = SCHED_STRIDE;
+
+  stride_stop = 0;
+  stride_spins[0] = stride_spins[1] = 0;
+  group_init(&group, "stride_done", 2);
+  attr.tickets = 300;
+  thread_t *rich = group_spawn_attr(&group, &attr, stride_worker, (void *)0);
+  attr.tickets = 100;
+  thread_t *poor = group_spawn_attr(&group, &attr, stride_worker, (void *)1);
+  Assert(rich != NULL && poor != NULL);
+  Assert(kmt->set_tickets(poor, 0) == -1);
+  group_wait(&group, 2);
+  printf("stride spins %d : %d\n", stride_spins[0], stride_spins[1]);
+  Assert(stride_spins[1] > 0 && stride_spins[1] * 2 < stride_spins[0]);
+
+  char path[MAXPATHLEN], name[32], buf[256];
+  strcpy(path, "/proc/");
+  itoa(rich->tid, 10, 1, name);
+  strcat(path, name);
+  strcat(path, "/sched");
+  int fd = vfs->open(path, O_RDONLY);
+  Assert(fd != -1);
+  size_t size = vfs->read(fd, buf, 255);
+  buf[size] = '\0';
+  printf("%s", buf);
+  buf[16] = '\0';
+  Assert(strcmp(buf, "Policy:   stride") == 0);
+  Assert(vfs->close(fd) == 0);
+
+  group_join(&group, 2);
+  return 1;
+}
+
+static volatile int mlfq_spins;
+
+static void stride_busy(void *arg) {
+  while (!stride_stop)
+    continue;
+}
+
+static void mlfq_worker(void *arg) {
+  for (mlfq_spins = 0; mlfq_spins < 1000000; ++mlfq_spins)
+    continue;
+}
+
+// A busy stride thread must leave an MLFQ thread on its CPU
+// a share, the MLFQ thread finishes while the other spins.
+int stride_share_test() {
+  group_t group;
+  thread_attr_t attr = THREAD_ATTR_INIT;
+  attr.pin_cpu = 0;
+
+  stride_stop = 0;
+  group_init(&group, "share_done", 2);
+  thread_t *mlfq = group_spawn_attr(&group, &attr, mlfq_worker, NULL);
+  attr.policy = SCHED_STRIDE;
+  thread_t *busy = group_spawn_attr(&group, &attr, stride_busy, NULL);
+  Assert(mlfq != NULL && busy != NULL);
+  group_wait(&group, 1);
+  Assert(mlfq_spins == 1000000);
+  stride_stop = 1;
+  group_join(&group, 1);
+  return 1;
+}
+
+#define EDF_PERIOD  20
+#define EDF_PERIODS 5
+
+static uint32_t edf_elapsed;
+
+static void periodic(void *arg) {
+  uint32_t start = uptime();
+  for (int i = 0; i < EDF_PERIODS; ++i)
+    Assert(kmt->wait_period() == 0);
+  edf_elapsed = uptime() - start;
+}
+
+// Budgets are charged every tick, so a thread may overrun its
+// budget by up to one tick per period.
+#define EDF_TICK    10
+#define EDF_BUDGET  5
+#define EDF_HUNGRY  50  // period, long enough that the overrun stays small
+
+static uint32_t edf_ran;
+
+// Spins for EDF_PERIODS periods without waiting. Gaps in uptime()
+// longer than a ms are time it did not run.
+static void hungry(void *arg) {
+  uint32_t start = uptime(), prev = start, now;
+  edf_ran = 0;
+  while ((now = uptime()) - start < EDF_PERIODS * EDF_HUNGRY) {
+    if (now - prev <= 1)
+      edf_ran += now - prev;
+    prev = now;
+  }
+}
+
+// Overload is rejected, an admitted thread is released once
+// every period, and one that overruns its budget is throttled.
+int edf_test() {
+  group_t group;
+  thread_attr_t attr = THREAD_ATTR_INIT;
+  attr.pin_cpu = 0;
+  attr.policy = SCHED_EDF;
+  attr.period = EDF_PERIOD;
+  group_init(&group, "edf_done", 1);
+
+  attr.budget = EDF_PERIOD + 1;
+  Assert(group_spawn_attr(&group, &attr, periodic, NULL) == NULL);
+  attr.budget = EDF_PERIOD;
+  Assert(group_spawn_attr(&group, &attr, periodic, NULL) == NULL);
+  Assert(kmt->wait_period() == -1);
+
+  attr.budget = 1;
+  Assert(group_spawn_attr(&group, &attr, periodic, NULL) != NULL);
+  group_join(&group, 0);
+  printf("%d periods of %d ms in %d ms\n", EDF_PERIODS, EDF_PERIOD, edf_elapsed);
+  Assert(edf_elapsed >= (EDF_PERIODS - 1) * EDF_PERIOD);
+  Assert(edf_elapsed <= (EDF_PERIODS + 1) * EDF_PERIOD);
+
+  // a thread that never waits is throttled to its budget
+  group_init(&group, "edf_done", 1);
+  attr.pin_cpu = -1;
+  attr.period = EDF_HUNGRY;
+  attr.budget = EDF_BUDGET;
+  Assert(group_spawn_attr(&group, &attr, hungry, NULL) != NULL);
+  group_join(&group, 0);
+  printf("ran %d ms of %d ms\n", edf_ran, EDF_PERIODS * EDF_HUNGRY);
+  Assert(edf_ran <= EDF_PERIODS * (EDF_BUDGET + EDF_TICK));
+  return 1;
+}
+
+/*------------------------------------------
+                memleak test
+  ------------------------------------------*/
+
+#ifdef DEBUG_MEM
+
+#define NR_LEAKS   8
+#define LEAK_SIZE  2000
+
+static void *leaks[NR_LEAKS];
+
+// every block is accounted to the return address in here
+static void __attribute__((noinline)) leak_some() {
+  for (int i = 0; i < NR_LEAKS; ++i)
+    leaks[i] = pmm->alloc(LEAK_SIZE);
+}
+
+// Find the memleak line of a caller inside leak_some, parse its
+// live objs, live bytes and allocs. Returns 0 if it is not listed.
+static int leak_site(int *vals) {
+  uintptr_t start = (uintptr_t)leak_some;
+  const char *text = proc_read("/proc/memleak");
+  while (*text != '\0') {
+    if (text[0] == '0' && text[1] == 'x') {
+      uintptr_t caller = 0;
+      for (text += 2; (*text >= '0' && *text <= '9') ||
+                      (*text >= 'a' && *text <= 'f'); ++text)
+        caller = caller * 16 + (*text <= '9' ? *text - '0' : *text - 'a' + 10);
+      if (caller > start && caller < start + 128) {
+        int found = 0;
+        while (found < 3) {
+          while (*text == ' ')
+            text++;
+          vals[found] = 0;
+          while (*text >= '0' && *text <= '9')
+            vals[found] = vals[found] * 10 + (*text++ - '0');
+          found++;
+        }
+        return 1;
+      }
+    }
+    while (*text != '\n' && *text != '\0')
+      text++;
+    if (*text == '\n')
+      text++;
+  }
+  return 0;
+}
+
+// Blocks still held show up under their call site, and the site
+// is gone once they are freed.
+int memleak_test() {
+  int vals[3];
+  leak_some();
+  Assert(leak_site(vals) == 1);
+  Assert(vals[0] == NR_LEAKS);
+  Assert(vals[1] == NR_LEAKS * LEAK_SIZE);
+  Assert(vals[2] >= NR_LEAKS);
+  for (int i = 0; i < NR_LEAKS; ++i)
+    pmm->free(leaks[i]);
+  Assert(leak_site(vals) == 0);
+  return 1;
+}
+
+#endif
+
 /*------------------------------------------
                   lock test
   ------------------------------------------*/
@@ -176,6 +980,332 @@ void lock_test() {
   kmt->create(&c, addsum, (void *)N);
 }
 
+#define NR_ADDERS 4
+#define NR_ADDS   100000
+
+static volatile int _count = 0;
+static spinlock_t count_lock = SPINLOCK_INIT("count_lock");
+
+static void addcount(void *arg) {
+  for (int i = 0; i < NR_ADDS; ++i) {
+    kmt->spin_lock(&count_lock);
+    _count++;
+    kmt->spin_unlock(&count_lock);
+  }
+}
+
+// Every ticket is served once, and the lock ends up free.
+int spin_test() {
+  group_t group;
+  _count = 0;
+  group_init(&group, "adders_done", NR_ADDERS);
+  for (int i = 0; i < NR_ADDERS; ++i)
+    group_spawn(&group, addcount, NULL);
+  group_join(&group, 0);
+  Assert(_count == NR_ADDERS * NR_ADDS);
+  Assert(count_lock.next == count_lock.owner);
+  return 1;
+}
+
+#ifdef DEBUG_LOCKSTAT
+#define NR_STAT_ADDS 10000
+
+static spinlock_t stat_lock = SPINLOCK_INIT("stat_lock");
+
+// Holds the lock for a while, so that other CPUs queue up.
+static void addcount_slow(void *arg) {
+  for (int i = 0; i < NR_STAT_ADDS; ++i) {
+    kmt->spin_lock(&stat_lock);
+    for (int volatile j = 0; j < 100; ++j)
+      continue;
+    _count++;
+    kmt->spin_unlock(&stat_lock);
+  }
+}
+
+// acquired and contended of stat_lock, 0 before its first use
+static void read_lockstat(int *vals) {
+  vals[0] = vals[1] = 0;
+  proc_field(proc_read("/proc/locks"), "stat_lock", vals, 2);
+}
+
+// One thread on every CPU fights for stat_lock, and its row in
+// /proc/locks counts every acquisition and some contention.
+int lockstat_test() {
+  int before[2], after[2];
+  read_lockstat(before);
+
+  group_t group;
+  thread_attr_t attr = THREAD_ATTR_INIT;
+  _count = 0;
+  group_init(&group, "stat_done", _ncpu());
+  for (int cpu = 0; cpu < _ncpu(); ++cpu) {
+    attr.pin_cpu = cpu;
+    group_spawn_attr(&group, &attr, addcount_slow, NULL);
+  }
+  group_join(&group, 0);
+  Assert(_count == _ncpu() * NR_STAT_ADDS);
+
+  read_lockstat(after);
+  printf("stat_lock acquired %d contended %d\n",
+    after[0] - before[0], after[1] - before[1]);
+  Assert(after[0] - before[0] >= _ncpu() * NR_STAT_ADDS);
+  if (_ncpu() > 1)
+    Assert(after[1] > before[1]);
+  return 1;
+}
+#endif
+
+#define NR_MUTEX_ADDS 1000
+
+static mutex_t count_mutex = MUTEX_INIT("count_mutex");
+
+static void addcount_sleepy(void *arg) {
+  for (int i = 0; i < NR_MUTEX_ADDS; ++i) {
+    kmt->mutex_lock(&count_mutex);
+    int count = _count;
+    // give up the CPU inside, so others have to block
+    if (i % 16 == 0)
+      _yield();
+    _count = count + 1;
+    kmt->mutex_unlock(&count_mutex);
+  }
+}
+
+// Holders may be preempted, and no update is lost.
+int mutex_test() {
+  group_t group;
+  _count = 0;
+  group_init(&group, "mutex_adders_done", NR_ADDERS);
+  for (int i = 0; i < NR_ADDERS; ++i)
+    group_spawn(&group, addcount_sleepy, NULL);
+  group_join(&group, 0);
+  Assert(_count == NR_ADDERS * NR_MUTEX_ADDS);
+  Assert(count_mutex.locked == 0 && count_mutex.owner == NULL);
+  Assert(count_mutex.nwaiters == 0);
+  Assert(waitqueue_empty(&count_mutex.waiters));
+  return 1;
+}
+
+#define NR_RW_READERS 3
+#define NR_RW_WRITERS 2
+#define NR_RW_ROUNDS  1000
+
+static rwlock_t rw_lock;
+static volatile int rw_first, rw_second;
+
+// a writer keeps the pair unequal for a while
+static void rw_writer(void *arg) {
+  for (int i = 0; i < NR_RW_ROUNDS; ++i) {
+    kmt->write_lock(&rw_lock);
+    rw_first++;
+    if (rw_lock.sleepable && i % 16 == 0)
+      _yield();
+    rw_second++;
+    kmt->write_unlock(&rw_lock);
+  }
+}
+
+static void rw_reader(void *arg) {
+  for (int i = 0; i < NR_RW_ROUNDS; ++i) {
+    kmt->read_lock(&rw_lock);
+    Assert(rw_first == rw_second);
+    kmt->read_unlock(&rw_lock);
+  }
+}
+
+static void rw_stuck_writer(void *arg) {
+  kmt->write_lock(&rw_lock);
+  Panic("torn down writer got the lock");
+}
+
+static void rw_late_reader(void *arg) {
+  kmt->read_lock(&rw_lock);
+  kmt->read_unlock(&rw_lock);
+}
+
+// Readers never see a writer halfway, in both flavours, and a
+// writer torn down while queued does not strand readers.
+int rwlock_test() {
+  for (int sleepable = 0; sleepable <= 1; ++sleepable) {
+    group_t group;
+    rw_first = rw_second = 0;
+    kmt->rwlock_init(&rw_lock, "rw_lock", sleepable);
+    group_init(&group, "rw_done", NR_RW_READERS + NR_RW_WRITERS);
+    for (int i = 0; i < NR_RW_READERS + NR_RW_WRITERS; ++i)
+      group_spawn(&group, i < NR_RW_READERS ? rw_reader : rw_writer, NULL);
+    group_join(&group, 0);
+    Assert(rw_first == NR_RW_WRITERS * NR_RW_ROUNDS);
+    Assert(rw_second == rw_first);
+    Assert(rw_lock.state == 0 && rw_lock.writers == 0);
+    Assert(rw_lock.nwriters_waiting == 0);
+    Assert(waitqueue_empty(&rw_lock.read_waiters));
+    Assert(waitqueue_empty(&rw_lock.write_waiters));
+  }
+
+  group_t group;
+  thread_t writer;
+  kmt->rwlock_init(&rw_lock, "rw_lock", 1);
+  kmt->read_lock(&rw_lock);
+  Assert(kmt->create(&writer, rw_stuck_writer, NULL) == 0);
+  while (rw_lock.nwriters_waiting == 0)
+    _yield();
+  group_init(&group, "rw_late_done", 1);
+  group_spawn(&group, rw_late_reader, NULL);
+  while (waitqueue_empty(&rw_lock.read_waiters))
+    _yield();
+  kmt->teardown(&writer);
+  kmt->read_unlock(&rw_lock);
+  group_join(&group, 0);
+  Assert(rw_lock.state == 0 && rw_lock.nwriters_waiting == 0);
+  return 1;
+}
+
+#define NR_RCU_READERS 3
+#define NR_RCU_UPDATES 200
+#define RCU_ALIVE      0x600d
+#define RCU_FREED      0xdead
+
+typedef struct rcu_node {
+  int magic;
+  int version;
+} rcu_node_t;
+
+static rcu_node_t *rcu_shared;
+static volatile int rcu_done;
+
+static void rcu_reader(void *arg) {
+  int last = 0;
+  while (!rcu_done) {
+    kmt->rcu_read_lock();
+    rcu_node_t *node = rcu_dereference(rcu_shared);
+    int version = node->version;
+    for (int i = 0; i < 100; ++i)
+      Assert(node->magic == RCU_ALIVE);
+    kmt->rcu_read_unlock();
+    // versions only go up
+    Assert(version >= last);
+    last = version;
+  }
+}
+
+// A node is never poisoned while a reader may still hold it.
+int rcu_test() {
+  group_t group;
+  rcu_done = 0;
+  rcu_shared = pmm->alloc(sizeof(rcu_node_t));
+  rcu_shared->magic = RCU_ALIVE;
+  rcu_shared->version = 0;
+  group_init(&group, "rcu_done", NR_RCU_READERS);
+  for (int i = 0; i < NR_RCU_READERS; ++i)
+    group_spawn(&group, rcu_reader, NULL);
+
+  for (int i = 1; i <= NR_RCU_UPDATES; ++i) {
+    rcu_node_t *node = pmm->alloc(sizeof(rcu_node_t));
+    node->magic = RCU_ALIVE;
+    node->version = i;
+    rcu_node_t *old = rcu_shared;
+    rcu_assign_pointer(rcu_shared, node);
+    kmt->synchronize_rcu();
+    old->magic = RCU_FREED;
+    pmm->free(old);
+  }
+
+  rcu_done = 1;
+  group_join(&group, 0);
+  pmm->free(rcu_shared);
+  return 1;
+}
+
+#define NR_COND_PRODUCERS 2
+#define NR_COND_CONSUMERS 2
+#define NR_COND_ITEMS     1000
+#define COND_BUFSIZE      4
+
+static mutex_t buf_mutex = MUTEX_INIT("buf_mutex");
+static cond_t not_full = COND_INIT("not_full");
+static cond_t not_empty = COND_INIT("not_empty");
+static int buf[COND_BUFSIZE], buf_head, buf_count;
+static int consumed_sum;
+
+static void cond_producer(void *arg) {
+  for (int i = 1; i <= NR_COND_ITEMS; ++i) {
+    kmt->mutex_lock(&buf_mutex);
+    while (buf_count == COND_BUFSIZE)
+      kmt->cond_wait(&not_full, &buf_mutex);
+    buf[(buf_head + buf_count++) % COND_BUFSIZE] = i;
+    kmt->cond_signal(&not_empty);
+    kmt->mutex_unlock(&buf_mutex);
+  }
+}
+
+static void cond_consumer(void *arg) {
+  int n = (int)arg;
+  for (int i = 0; i < n; ++i) {
+    kmt->mutex_lock(&buf_mutex);
+    while (buf_count == 0)
+      kmt->cond_wait(&not_empty, &buf_mutex);
+    consumed_sum += buf[buf_head];
+    buf_head = (buf_head + 1) % COND_BUFSIZE;
+    buf_count--;
+    kmt->cond_signal(&not_full);
+    kmt->mutex_unlock(&buf_mutex);
+  }
+}
+
+static volatile int gate_open;
+
+static void cond_gate(void *arg) {
+  kmt->mutex_lock(&buf_mutex);
+  while (!gate_open)
+    kmt->cond_wait(&not_empty, &buf_mutex);
+  kmt->mutex_unlock(&buf_mutex);
+}
+
+// A bounded buffer loses and repeats nothing, and a broadcast
+// lets every waiter through.
+int cond_test() {
+  group_t group;
+  int nthreads = NR_COND_PRODUCERS + NR_COND_CONSUMERS;
+  int per_consumer = NR_COND_PRODUCERS * NR_COND_ITEMS / NR_COND_CONSUMERS;
+  buf_head = buf_count = consumed_sum = 0;
+  group_init(&group, "cond_done", nthreads);
+  for (int i = 0; i < nthreads; ++i) {
+    if (i < NR_COND_PRODUCERS)
+      group_spawn(&group, cond_producer, NULL);
+    else
+      group_spawn(&group, cond_consumer, (void *)per_consumer);
+  }
+  group_join(&group, 0);
+  Assert(buf_count == 0);
+  Assert(consumed_sum ==
+         NR_COND_PRODUCERS * (NR_COND_ITEMS * (NR_COND_ITEMS + 1) / 2));
+
+  gate_open = 0;
+  group_init(&group, "gate_done", nthreads);
+  for (int i = 0; i < nthreads; ++i)
+    group_spawn(&group, cond_gate, NULL);
+  // wait until all of them sleep on the gate
+  while (1) {
+    kmt->mutex_lock(&buf_mutex);
+    kmt->spin_lock(&not_empty.lock);
+    int n = 0;
+    for (thread_t *t = not_empty.waiters.head; t != NULL; t = t->wq_next)
+      n++;
+    kmt->spin_unlock(&not_empty.lock);
+    if (n == nthreads)
+      break;
+    kmt->mutex_unlock(&buf_mutex);
+    _yield();
+  }
+  gate_open = 1;
+  kmt->cond_broadcast(&not_empty);
+  Assert(waitqueue_empty(&not_empty.waiters));
+  kmt->mutex_unlock(&buf_mutex);
+  group_join(&group, 0);
+  return 1;
+}
+
 /*------------------------------------------
                   sem test
   ------------------------------------------*/
@@ -511,11 +1641,38 @@ int procfs_test() {
 
   fd = vfs->open("/proc/meminfo", O_RDONLY);
   Assert(fd != -1);
-  size = vfs->read(fd, buf, 1024);
+  size = vfs->read(fd, buf, 1023);
   buf[size] = '\0';
   printf("%s\n", buf);
+  buf[9] = '\0';
+  Assert(strcmp(buf, "MemTotal:") == 0);
   Assert(vfs->close(fd) == 0);
 
+  fd = vfs->open("/proc/slabinfo", O_RDONLY);
+  Assert(fd != -1);
+  size = vfs->read(fd, buf, 1023);
+  buf[size] = '\0';
+  printf("%s\n", buf);
+  Assert(vfs->close(fd) == 0);
+
+  // procinfo goes away with the thread
+  kmt->teardown(&thread);
+  Assert(vfs->open(path, O_RDONLY) == -1);
+
+  return 1;
+}
+
+// A freed tid is not handed out again right away.
+int tid_test() {
+  thread_t a, b;
+  kmt->create(&a, nothing, NULL);
+  int tid = a.tid;
+  kmt->teardown(&a);
+  kmt->create(&b, nothing, NULL);
+  Assert(b.tid != tid);
+  Assert(kmt->set_priority(&a, 0) == -1);
+  Assert(kmt->set_priority(&b, 0) == 0);
+  kmt->teardown(&b);
   return 1;
 }
 
@@ -526,10 +1683,36 @@ int procfs_test() {
 void test_run(void *arg) {
   Test(inode_manager_test);
   Test(string_test);
+  Test(buddy_test);
+  Test(slab_test);
+  Test(magazine_test);
+  Test(realloc_test);
+  Test(oom_test);
+  Test(arena_test);
   Test(fs_manager_test);
   Test(kvfs_test);
   Test(devfs_test);
   Test(procfs_test);
+#ifdef DEBUG_MEM
+  Test(memleak_test);
+#endif
+  Test(smp_test);
+  Test(runqueue_test);
+  Test(blocked_test);
+  Test(waitqueue_test);
+  Test(tid_test);
+  Test(spin_test);
+#ifdef DEBUG_LOCKSTAT
+  Test(lockstat_test);
+#endif
+  Test(mutex_test);
+  Test(rwlock_test);
+  Test(rcu_test);
+  Test(cond_test);
+  Test(mlfq_test);
+  Test(stride_test);
+  Test(stride_share_test);
+  Test(edf_test);
 
   char buf[10];
   size_t nread = vfs->read(STDIN_FILENO, buf, 10);